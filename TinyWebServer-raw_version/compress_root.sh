@@ -0,0 +1,31 @@
+#!/bin/bash
+#给网站根目录下的文本文件生成预先压缩好的版本(.gz，装了brotli的话还有.br)，服务器按Accept-Encoding直接发，不用每次现压缩
+#用法：./compress_root.sh [网站根目录]，默认是./root，改了文件之后重新运行一次
+#压缩后没有变小的不保留；压缩版本的修改时间和原文件一样，服务器只用不比原文件旧的压缩版本
+
+root=${1:-./root}
+min_size=256    #太小的文件压缩了也省不了几个字节
+
+find "$root" -type f \( -name '*.html' -o -name '*.htm' -o -name '*.css' -o -name '*.js' -o -name '*.json' \
+    -o -name '*.svg' -o -name '*.txt' -o -name '*.xml' \) -size +${min_size}c | while read -r file
+do
+    size=$(stat -c %s "$file")
+
+    gzip -9 -n -c "$file" > "$file.gz.tmp"
+    if [ "$(stat -c %s "$file.gz.tmp")" -lt "$size" ]; then
+        touch -r "$file" "$file.gz.tmp"
+        mv -f "$file.gz.tmp" "$file.gz"
+    else
+        rm -f "$file.gz.tmp" "$file.gz"
+    fi
+
+    if command -v brotli > /dev/null; then
+        brotli -q 11 -c "$file" > "$file.br.tmp"
+        if [ "$(stat -c %s "$file.br.tmp")" -lt "$size" ]; then
+            touch -r "$file" "$file.br.tmp"
+            mv -f "$file.br.tmp" "$file.br"
+        else
+            rm -f "$file.br.tmp" "$file.br"
+        fi
+    fi
+done
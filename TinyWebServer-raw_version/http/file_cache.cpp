@@ -0,0 +1,356 @@
+#include "file_cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+
+//文件被修改、删除、移动、权限改变时都要让缓存失效
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF)
+
+file_cache::file_cache() : m_inotifyfd(-1), m_generation(0) {}
+
+file_cache::~file_cache()
+{
+    invalidate_all();
+    if (m_inotifyfd != -1)
+    {
+        close(m_inotifyfd);
+    }
+}
+
+bool file_cache::init(const char *doc_root)
+{
+    m_doc_root = doc_root;
+
+    m_inotifyfd = inotify_init1(IN_CLOEXEC);
+    if (m_inotifyfd < 0)
+    {
+        return false;
+    }
+
+    //先监听根目录，子目录等到第一次有文件从里面加载时再监听
+    int wd = inotify_add_watch(m_inotifyfd, doc_root, WATCH_MASK);
+    if (wd < 0)
+    {
+        return false;
+    }
+    m_dirs[wd] = "";
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, inotify_thread, this) != 0)
+    {
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+bool file_cache::canonical_url(const char *url, std::string &out)
+{
+    out.clear();
+    const char *p = url;
+    while (*p)
+    {
+        while (*p == '/')
+            ++p;
+        const char *seg = p;
+        while (*p && *p != '/')
+            ++p;
+        int len = p - seg;
+        if (len == 0 || (len == 1 && seg[0] == '.'))
+            continue;
+        if (len == 2 && seg[0] == '.' && seg[1] == '.')
+            return false;
+        out += '/';
+        out.append(seg, len);
+    }
+    if (out.empty())
+        out = "/";
+    return true;
+}
+
+file_entry *file_cache::acquire(const char *url, int &err)
+{
+    std::string key;
+    if (!canonical_url(url, key))
+    {
+        err = EACCES;
+        return NULL;
+    }
+
+    //命中：只加读锁，多个线程可以同时查
+    m_lock.rdlock();
+    std::unordered_map<std::string, file_entry *>::iterator it = m_files.find(key);
+    if (it != m_files.end())
+    {
+        file_entry *entry = it->second;
+        entry->ref++;
+        m_lock.unlock();
+        return entry;
+    }
+    m_lock.unlock();
+
+    //未命中：打开文件，放进缓存
+    return load(key.c_str(), err);
+}
+
+void file_cache::release(file_entry *entry)
+{
+    if (--entry->ref == 0)
+    {
+        if (entry->address)
+        {
+            munmap(entry->address, entry->st.st_size);
+        }
+        close(entry->fd);
+        delete entry;
+    }
+}
+
+//url已经规范化了
+file_entry *file_cache::load(const char *url, int &err)
+{
+    //先把目录监听上，再记下当前的代数，之后再stat和open，
+    //这样如果在加载期间文件被改了，一定能通过代数的变化发现，不会把旧的内容放进缓存
+    watch_dir(url);
+    unsigned generation = m_generation;
+
+    std::string real_file = m_doc_root + url;   //服务器的项目根目录 + 请求文件的目录， 合体
+    struct stat st;
+    if (stat(real_file.c_str(), &st) < 0)
+    {
+        err = ENOENT;
+        return NULL;
+    }
+
+    //判断访问权限
+    if (!(st.st_mode & S_IROTH))
+    {
+        err = EACCES;
+        return NULL;
+    }
+
+    //判断是否是目录
+    if (S_ISDIR(st.st_mode))
+    {
+        err = EISDIR;
+        return NULL;
+    }
+
+    int fd = open(real_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        err = ENOENT;
+        return NULL;
+    }
+
+    file_entry *entry = new file_entry;
+    entry->fd = fd;
+    entry->st = st;
+    entry->address = NULL;
+    entry->mime = lookup_mime_type(url);
+    entry->encodings = probe_encodings(real_file, st);
+    entry->ref = 1;   //调用者的引用
+    entry->stale = false;
+    if (st.st_size > 0 && st.st_size <= MMAP_MAX_SIZE)
+    {
+        void *address = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (address != MAP_FAILED)
+        {
+            entry->address = (char *)address;
+        }
+    }
+    else if (st.st_size > MMAP_MAX_SIZE)
+    {
+        //大文件不映射，发送时用sendfile按窗口从头读到尾，让内核加大预读
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    m_lock.wrlock();
+    if (generation != m_generation)
+    {
+        //加载期间有文件变了，这一份可能是旧的，只给这一次请求用，不放进缓存
+        //它不在m_files里，文件再变也不会被通知到，所以一开始就标成过时，响应缓存不会用它生成响应
+        entry->stale = true;
+        m_lock.unlock();
+        return entry;
+    }
+    std::pair<std::unordered_map<std::string, file_entry *>::iterator, bool> ret =
+        m_files.insert(std::make_pair(std::string(url), entry));
+    if (!ret.second)
+    {
+        //别的线程已经抢先把这个文件放进去了，用它的，自己这份丢掉
+        file_entry *cached = ret.first->second;
+        cached->ref++;
+        m_lock.unlock();
+        release(entry);
+        return cached;
+    }
+    entry->ref++;   //缓存自己的引用
+    m_lock.unlock();
+    return entry;
+}
+
+//看原文件旁边有没有预先压缩好的版本，比原文件旧的不算，可能是改了原文件之后没有重新压缩
+//请求的本身就是压缩版本时不再往下找
+int file_cache::probe_encodings(const std::string &real_file, const struct stat &st)
+{
+    int encodings = 0;
+    for (int i = 0; i < ENCODING_COUNT; ++i)
+    {
+        const char *suffix = encoding_suffix(encoding_list[i]);
+        int len = strlen(suffix);
+        if (real_file.size() > (size_t)len && real_file.compare(real_file.size() - len, len, suffix) == 0)
+            return 0;
+    }
+    for (int i = 0; i < ENCODING_COUNT; ++i)
+    {
+        struct stat variant;
+        std::string path = real_file + encoding_suffix(encoding_list[i]);
+        if (stat(path.c_str(), &variant) == 0 && S_ISREG(variant.st_mode) && (variant.st_mode & S_IROTH) &&
+            variant.st_mtime >= st.st_mtime)
+            encodings |= encoding_list[i];
+    }
+    return encodings;
+}
+
+void file_cache::watch_dir(const char *url)
+{
+    const char *p = strrchr(url, '/');
+    if (p == NULL || p == url)
+    {
+        return;   //在根目录下，init时已经监听了
+    }
+    std::string dir(url, p - url);
+
+    std::string real_dir = m_doc_root + dir;
+    int wd = inotify_add_watch(m_inotifyfd, real_dir.c_str(), WATCH_MASK);
+    if (wd < 0)
+    {
+        return;
+    }
+    //同一个目录inotify返回同一个wd，已经有的不覆盖
+    m_lock.wrlock();
+    m_dirs.insert(std::make_pair(wd, dir));
+    m_lock.unlock();
+}
+
+void file_cache::invalidate(const std::string &url)
+{
+    file_entry *entry = NULL;
+    m_lock.wrlock();
+    m_generation++;
+    std::unordered_map<std::string, file_entry *>::iterator it = m_files.find(url);
+    if (it != m_files.end())
+    {
+        entry = it->second;
+        m_files.erase(it);
+    }
+    m_lock.unlock();
+
+    //释放缓存自己的引用，还在发送这个文件的连接手里的引用不受影响
+    if (entry)
+    {
+        entry->stale = true;
+        release(entry);
+    }
+}
+
+//原文件和它的压缩版本互相牵连：原文件变了，压缩版本就过时了；压缩版本出现、变了或者没了，原文件记下的可用版本要重新检查
+void file_cache::invalidate_related(const std::string &url)
+{
+    for (int i = 0; i < ENCODING_COUNT; ++i)
+    {
+        std::string suffix = encoding_suffix(encoding_list[i]);
+        if (url.size() > suffix.size() && url.compare(url.size() - suffix.size(), suffix.size(), suffix) == 0)
+        {
+            invalidate(url.substr(0, url.size() - suffix.size()));
+            return;
+        }
+    }
+    for (int i = 0; i < ENCODING_COUNT; ++i)
+        invalidate(url + encoding_suffix(encoding_list[i]));
+}
+
+void file_cache::invalidate_all()
+{
+    std::unordered_map<std::string, file_entry *> files;
+    m_lock.wrlock();
+    m_generation++;
+    files.swap(m_files);
+    m_lock.unlock();
+
+    for (std::unordered_map<std::string, file_entry *>::iterator it = files.begin(); it != files.end(); ++it)
+    {
+        it->second->stale = true;
+        release(it->second);
+    }
+}
+
+void *file_cache::inotify_thread(void *arg)
+{
+    file_cache *cache = (file_cache *)arg;
+    cache->run();
+    return cache;
+}
+
+//不断读取inotify事件，把变了的文件从缓存中踢掉
+void file_cache::run()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true)
+    {
+        int len = read(m_inotifyfd, buf, sizeof(buf));
+        if (len <= 0)
+        {
+            if (len < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+        {
+            struct inotify_event *event = (struct inotify_event *)p;
+
+            //事件队列溢出了，或者整个目录被删除、移动了，不知道具体是哪些文件，全部踢掉
+            if ((event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) || (event->mask & IN_ISDIR))
+            {
+                if (event->mask & IN_IGNORED)
+                {
+                    m_lock.wrlock();
+                    m_dirs.erase(event->wd);
+                    m_lock.unlock();
+                }
+                invalidate_all();
+                continue;
+            }
+            if (event->len == 0)
+            {
+                continue;
+            }
+
+            m_lock.rdlock();
+            std::unordered_map<int, std::string>::iterator it = m_dirs.find(event->wd);
+            std::string url = (it != m_dirs.end()) ? it->second : std::string();
+            bool found = (it != m_dirs.end());
+            m_lock.unlock();
+            if (!found)
+            {
+                continue;
+            }
+
+            url += "/";
+            url += event->name;
+            invalidate(url);
+            invalidate_related(url);
+        }
+    }
+    printf("inotify thread exit\n");
+    return;
+}
@@ -0,0 +1,90 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include "../lock/locker.h"
+#include "mime_types.h"
+
+//预先压缩好的版本，和原文件放在同一个目录下，文件名加上后缀，如 judge.html.br、judge.html.gz
+//可以用位或组合，表示一个文件有哪些压缩版本，或者客户端接受哪些编码
+enum CONTENT_ENCODING
+{
+    ENCODING_IDENTITY = 0,
+    ENCODING_GZIP = 1,
+    ENCODING_BR = 2
+};
+static const int ENCODING_COUNT = 2;
+static const int encoding_list[ENCODING_COUNT] = {ENCODING_BR, ENCODING_GZIP}; //按优先级排，br压得更小
+inline const char *encoding_suffix(int encoding)
+{
+    return encoding == ENCODING_BR ? ".br" : ".gz";
+}
+inline const char *encoding_name(int encoding)
+{
+    return encoding == ENCODING_BR ? "br" : "gzip";
+}
+
+//缓存中的一个文件，多个连接共用一份打开的fd、stat和mmap的内存
+//引用计数：缓存自己持有一个，每个正在发送它的连接各持有一个，文件被修改后从缓存踢掉也不影响正在发送的连接
+struct file_entry
+{
+    int fd;               //一直打开着的文件描述符
+    struct stat st;       //文件状态
+    char *address;        //mmap到内存中的起始位置，文件太大或为空时为NULL
+    const char *mime;     //按扩展名查到的MIME类型，加载时查一次
+    int encodings;        //旁边有哪些不比它旧的压缩版本，CONTENT_ENCODING的位或，加载时检查一次
+    std::atomic<int> ref; //引用计数，减到0时才munmap和close
+    std::atomic<bool> stale; //从缓存中踢掉时置为true，别人手里的这一份已经过时
+};
+
+//文件缓存，相对网站根目录的路径 -> file_entry
+//命中时只加读锁查一次哈希表，没有stat、open、mmap等系统调用
+//inotify监听网站根目录，文件被修改、删除、移动时踢掉对应的缓存项
+class file_cache
+{
+public:
+    static const int MMAP_MAX_SIZE = 4 * 1024 * 1024; //不超过这个大小的文件才mmap进内存
+
+    static file_cache *get_instance()
+    {
+        static file_cache instance;
+        return &instance;
+    }
+
+    //设置网站根目录，启动inotify监听线程
+    bool init(const char *doc_root);
+
+    //把url规范化：合并连续的'/'，去掉"."，有".."时返回false
+    //同一个文件只有一种写法，缓存项和监听的目录都按规范化的路径存，也不会访问到网站根目录外面
+    static bool canonical_url(const char *url, std::string &out);
+
+    //拿到url对应文件的缓存项并加一个引用，用完调用release
+    //失败返回NULL，err为ENOENT、EACCES(没有读权限或者路径里有"..")或EISDIR
+    file_entry *acquire(const char *url, int &err);
+    void release(file_entry *entry);
+
+private:
+    file_cache();
+    ~file_cache();
+    file_entry *load(const char *url, int &err);
+    void watch_dir(const char *url);
+    void invalidate(const std::string &url);
+    void invalidate_all();
+    void invalidate_related(const std::string &url);
+    int probe_encodings(const std::string &real_file, const struct stat &st);
+    static void *inotify_thread(void *arg);
+    void run();
+
+private:
+    std::string m_doc_root;                               //网站根目录
+    std::unordered_map<std::string, file_entry *> m_files; //规范化的路径 -> 缓存项
+    std::unordered_map<int, std::string> m_dirs;           //inotify watch描述符 -> 规范化的目录路径
+    rwlocker m_lock;                                       //保护上面两个表
+    int m_inotifyfd;
+    std::atomic<unsigned> m_generation; //每次踢掉缓存项加一，用来发现加载期间文件被修改
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <map>
 #include <mysql/mysql.h>
 #include <fstream>
+#include <ctype.h>
 
 //#define connfdET //边缘触发非阻塞
 #define connfdLT //水平触发阻塞
@@ -20,6 +21,12 @@ const char *error_404_title = "Not Found";
 const char *error_404_form = "The requested file was not found on this server.\n";
 const char *error_500_title = "Internal Error";
 const char *error_500_form = "There was an unusual problem serving the request file.\n";
+const char *partial_206_title = "Partial Content";
+const char *error_416_title = "Range Not Satisfiable";
+const char *error_416_form = "The requested range is not satisfiable.\n";
+
+//多段响应的分隔符每个响应不一样，用时间和一个计数拼出来
+static std::atomic<unsigned> boundary_counter(0);
 
 //当浏览器出现连接重置时，可能是网站根目录出错或http响应格式出错或者访问的文件中内容完全为空
 const char *doc_root = "/home/wensong/TinyWebServer-raw_version/root";
@@ -125,14 +132,28 @@ int http_conn::m_epollfd = -1;
 //关闭连接，关闭一个连接，客户总量减一
 void http_conn::close_conn(bool real_close)
 {
-    if (real_close && (m_sockfd != -1))
+    if (real_close)
     {
-        removefd(m_epollfd, m_sockfd);
-        m_sockfd = -1;
-        m_user_count--;
+        close_conn(m_generation);
     }
 }
 
+//只有连接还是generation这一代时才关闭，返回是否关了
+//工作线程和主线程的定时器可能同时来关，谁先把代数加一谁关，另一个什么也不做
+bool http_conn::close_conn(unsigned generation)
+{
+    int sockfd = m_sockfd;
+    if (sockfd == -1 || !m_generation.compare_exchange_strong(generation, generation + 1))
+    {
+        return false;
+    }
+    unmap();
+    removefd(m_epollfd, sockfd);
+    m_sockfd = -1;
+    m_user_count--;
+    return true;
+}
+
 //初始化连接,外部调用初始化套接字地址
 void http_conn::init(int sockfd, const sockaddr_in &addr)
 {
@@ -159,11 +180,26 @@ void http_conn::init()
     m_version = 0;
     m_content_length = 0;
     m_host = 0;
+    m_range = NULL;
+    m_if_range = NULL;
+    m_accept_encoding = 0;
+    m_encoding = ENCODING_IDENTITY;
+    m_vary = false;
+    m_mime = DEFAULT_MIME_TYPE;
+    m_range_count = 0;
+    m_range_next = 0;
+    m_multipart = false;
+    m_send_offset = 0;
+    m_send_left = 0;
+    m_readahead = 0;
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
     cgi = 0;
+    m_file = NULL;
+    m_response = NULL;
+    m_file_address = 0;
     memset(m_read_buf, '\0', READ_BUFFER_SIZE);
     memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
     memset(m_real_file, '\0', FILENAME_LEN);
@@ -328,15 +364,78 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
         text += strspn(text, " \t");
         m_host = text;
     }
+    else if (strncasecmp(text, "Range:", 6) == 0)
+    {
+        text += 6;
+        text += strspn(text, " \t");
+        m_range = text;
+    }
+    else if (strncasecmp(text, "If-Range:", 9) == 0)
+    {
+        text += 9;
+        text += strspn(text, " \t");
+        m_if_range = text;
+    }
+    else if (strncasecmp(text, "Accept-Encoding:", 16) == 0)
+    {
+        text += 16;
+        text += strspn(text, " \t");
+        m_accept_encoding = parse_accept_encoding(text);
+    }
     else
     {
         //printf("oop!unknow header: %s\n",text);
         LOG_INFO("oop!unknow header: %s", text);
-        Log::get_instance()->flush();
     }
     return NO_REQUEST;
 }
 
+//解析Accept-Encoding: gzip, deflate, br;q=0.8, *;q=0.1，返回接受的压缩版本的位或
+//q=0表示不接受，*代表没有单独列出来的编码
+int http_conn::parse_accept_encoding(const char *text)
+{
+    int accepted = 0;
+    int refused = 0;
+    bool wildcard = false;
+    while (*text)
+    {
+        text += strspn(text, " \t,");
+        int len = strcspn(text, " \t;,");
+        const char *name = text;
+        text += len;
+        text += strspn(text, " \t");
+        double q = 1;
+        if (*text == ';')
+        {
+            ++text;
+            text += strspn(text, " \t");
+            if (strncasecmp(text, "q=", 2) == 0)
+                q = atof(text + 2);
+        }
+        text += strcspn(text, ",");
+
+        int encoding = 0;
+        if (len == 1 && name[0] == '*')
+        {
+            if (q > 0)
+                wildcard = true;
+            continue;
+        }
+        for (int i = 0; i < ENCODING_COUNT; ++i)
+        {
+            if ((int)strlen(encoding_name(encoding_list[i])) == len && strncasecmp(name, encoding_name(encoding_list[i]), len) == 0)
+                encoding = encoding_list[i];
+        }
+        if (encoding && q > 0)
+            accepted |= encoding;
+        else if (encoding)
+            refused |= encoding;
+    }
+    if (wildcard)
+        accepted |= ENCODING_GZIP | ENCODING_BR;
+    return accepted & ~refused;
+}
+
 //判断http请求是否被完整读入
 http_conn::HTTP_CODE http_conn::parse_content(char *text)
 {
@@ -362,7 +461,6 @@ http_conn::HTTP_CODE http_conn::process_read()
         text = get_line();
         m_start_line = m_checked_idx;
         LOG_INFO("%s", text);
-        Log::get_instance()->flush();
         switch (m_check_state)
         {
         case CHECK_STATE_REQUESTLINE:
@@ -514,23 +612,203 @@ http_conn::HTTP_CODE http_conn::do_request()
     else
         strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
 
-    if (stat(m_real_file, &m_file_stat) < 0)
-        return NO_RESOURCE;
-    if (!(m_file_stat.st_mode & S_IROTH))
+    //带Range的GET只发文件的一部分，不能用缓存的整个响应
+    if (m_method != GET)
+        m_range = NULL;
+
+    //小文件先查响应缓存，命中时响应头也不用再生成
+    //客户端接受压缩时要先从文件缓存中知道有哪些压缩版本，才知道要哪一个响应
+    //"/a//b"、"/a/./b"都是"/a/b"，按一种写法查缓存，规范化后不会变长，直接写回去；有".."的不让访问
+    std::string path;
+    if (!file_cache::canonical_url(m_real_file + len, path))
         return FORBIDDEN_REQUEST;
-    if (S_ISDIR(m_file_stat.st_mode))
-        return BAD_REQUEST;
-    int fd = open(m_real_file, O_RDONLY);
-    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
+    strcpy(m_real_file + len, path.c_str());
+    const char *url = m_real_file + len;
+    if (!m_range && !m_accept_encoding)
+    {
+        m_response = response_cache::get_instance()->acquire(url, m_linger, ENCODING_IDENTITY);
+        if (m_response)
+            return FILE_REQUEST;
+    }
+
+    //从文件缓存中取，命中时没有stat、open、mmap
+    int err = 0;
+    m_file = file_cache::get_instance()->acquire(url, err);
+    if (!m_file)
+    {
+        if (err == EACCES)
+            return FORBIDDEN_REQUEST;
+        if (err == EISDIR)
+            return BAD_REQUEST;
+        return NO_RESOURCE;
+    }
+
+    //Content-Type按原文件的扩展名，换成压缩版本后m_file->mime是application/gzip
+    m_mime = m_file->mime;
+
+    //有预先压缩好的版本并且客户端接受，就发压缩版本，和原文件一样零拷贝发送，不用现压缩
+    //有压缩版本的文件，不管这次发的是哪个，响应都要带Vary，让中间的缓存按Accept-Encoding分开存
+    if (m_file->encodings)
+    {
+        m_vary = true;
+        for (int i = 0; i < ENCODING_COUNT; ++i)
+        {
+            if (!(m_file->encodings & m_accept_encoding & encoding_list[i]))
+                continue;
+            std::string variant_url = std::string(url) + encoding_suffix(encoding_list[i]);
+            file_entry *variant = file_cache::get_instance()->acquire(variant_url.c_str(), err);
+            if (variant)
+            {
+                file_cache::get_instance()->release(m_file);
+                m_file = variant;
+                m_encoding = encoding_list[i];
+                break;
+            }
+        }
+    }
+    if (!m_range && m_accept_encoding)
+    {
+        m_response = response_cache::get_instance()->acquire(url, m_linger, m_encoding);
+        if (m_response)
+            return FILE_REQUEST;
+    }
+    //范围请求的范围是对发送的这个版本而言的
+    m_file_stat = m_file->st;
+    if (m_range)
+    {
+        //范围请求直接按偏移sendfile，不映射整个文件
+        HTTP_CODE ret = parse_range();
+        if (ret != FILE_REQUEST)
+            return ret;
+    }
+    //太大的文件缓存里不映射，发送时按窗口sendfile，不管文件多大，每个连接都不占映射和缓冲区
+    m_file_address = m_file->address;
     return FILE_REQUEST;
 }
+//把时间格式化成HTTP的日期，如 Sun, 06 Nov 1994 08:49:37 GMT
+static void format_http_date(time_t t, char *buf, int size)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+//If-Range的值和文件的Last-Modified完全一样时Range才有效，否则文件已经变了，要发整个文件
+//没有ETag，所以带实体标签的If-Range总是不匹配
+bool http_conn::if_range_match()
+{
+    if (m_if_range[0] == '"' || strncmp(m_if_range, "W/", 2) == 0)
+        return false;
+    char date[64];
+    format_http_date(m_file_stat.st_mtime, date, sizeof(date));
+    return strcmp(m_if_range, date) == 0;
+}
+
+//解析Range: bytes=0-499,1000-,-500
+//语法不对、段太多或者If-Range不匹配时返回FILE_REQUEST，当作没有Range，发整个文件
+//一段都不在文件范围内时返回RANGE_NOT_SATISFIABLE
+http_conn::HTTP_CODE http_conn::parse_range()
+{
+    if (m_if_range && !if_range_match())
+        return FILE_REQUEST;
+    if (strncasecmp(m_range, "bytes=", 6) != 0)
+        return FILE_REQUEST;
+    off_t size = m_file_stat.st_size;
+    char *p = m_range + 6;
+    int specs = 0;
+    m_range_count = 0;
+    while (*p)
+    {
+        p += strspn(p, " \t");
+        char *end;
+        off_t first, last;
+        if (*p == '-')
+        {
+            //最后n个字节
+            if (!isdigit(p[1]))
+                return FILE_REQUEST;
+            off_t n = strtoll(p + 1, &end, 10);
+            first = n >= size ? 0 : size - n;
+            last = n > 0 ? size - 1 : -1;
+        }
+        else if (isdigit(*p))
+        {
+            first = strtoll(p, &end, 10);
+            if (*end != '-')
+                return FILE_REQUEST;
+            ++end;
+            if (isdigit(*end))
+            {
+                last = strtoll(end, &end, 10);
+                if (last < first)
+                    return FILE_REQUEST;
+                if (last >= size)
+                    last = size - 1;
+            }
+            else
+                last = size - 1;
+        }
+        else
+            return FILE_REQUEST;
+        p = end + strspn(end, " \t");
+        if (*p == ',')
+            ++p;
+        else if (*p)
+            return FILE_REQUEST;
+        ++specs;
+
+        //超出文件范围的段跳过
+        if (first < size && first <= last)
+        {
+            if (m_range_count == MAX_RANGES)
+                return FILE_REQUEST;
+            m_ranges[m_range_count].start = first;
+            m_ranges[m_range_count].end = last;
+            ++m_range_count;
+        }
+    }
+    if (specs == 0)
+        return FILE_REQUEST;
+    if (m_range_count == 0)
+        return RANGE_NOT_SATISFIABLE;
+    return PARTIAL_REQUEST;
+}
+
+//多段响应中第i段前面的分隔行和段头部，i等于m_range_count时是结束的分隔行
+int http_conn::format_part(char *buf, int size, int i)
+{
+    if (i == m_range_count)
+        return snprintf(buf, size, "\r\n--%s--\r\n", m_boundary);
+    return snprintf(buf, size, "\r\n--%s\r\nContent-Type:%s\r\nContent-Range:bytes %lld-%lld/%lld\r\n\r\n",
+                    m_boundary, m_mime, (long long)m_ranges[i].start, (long long)m_ranges[i].end, (long long)m_file_stat.st_size);
+}
+
+//多段响应的上一段发完了，准备下一段的段头部和文件范围
+void http_conn::next_part()
+{
+    m_iv[0].iov_base = m_part_buf;
+    m_iv[0].iov_len = format_part(m_part_buf, PART_HEADER_SIZE, m_range_next);
+    m_iv_count = 1;
+    if (m_range_next < m_range_count)
+    {
+        m_send_offset = m_ranges[m_range_next].start;
+        m_send_left = m_ranges[m_range_next].end - m_ranges[m_range_next].start + 1;
+    }
+    ++m_range_next;
+}
+
 void http_conn::unmap()
 {
-    if (m_file_address)
+    m_file_address = 0;
+    if (m_file)
+    {
+        file_cache::get_instance()->release(m_file);
+        m_file = NULL;
+    }
+    if (m_response)
     {
-        munmap(m_file_address, m_file_stat.st_size);
-        m_file_address = 0;
+        response_cache::get_instance()->release(m_response);
+        m_response = NULL;
     }
 }
 
@@ -547,7 +825,28 @@ bool http_conn::write()
 
     while (1)
     {
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        if (m_iv_count > 0)
+            temp = writev(m_sockfd, m_iv, m_iv_count);
+        else
+        {
+            //范围请求和大文件的内容用sendfile从文件缓存中打开的fd按偏移发，不读进用户态，也不映射文件
+            //一次最多发一个窗口，并保证当前位置后面的一个窗口已经让内核开始预读，磁盘读和网络发送能重叠起来
+            off_t end = m_send_offset + m_send_left;
+            if (m_readahead < m_send_offset)
+                m_readahead = m_send_offset;
+            while (m_readahead < m_send_offset + 2 * STREAM_WINDOW && m_readahead < end)
+            {
+                posix_fadvise(m_file->fd, m_readahead, STREAM_WINDOW, POSIX_FADV_WILLNEED);
+                m_readahead += STREAM_WINDOW;
+            }
+            temp = sendfile(m_sockfd, m_file->fd, &m_send_offset, m_send_left < STREAM_WINDOW ? m_send_left : STREAM_WINDOW);
+            if (temp == 0)
+            {
+                //文件被截断了，发不够Content-Length
+                unmap();
+                return false;
+            }
+        }
 
         if (temp < 0)
         {
@@ -562,18 +861,29 @@ bool http_conn::write()
 
         bytes_have_send += temp;
         bytes_to_send -= temp;
-        if (bytes_have_send >= m_iv[0].iov_len)
+        if (m_iv_count == 0)
+            m_send_left -= temp;
+        //把m_iv推进到还没发送的位置，m_iv[0]不一定是m_write_buf(可能是缓存的响应)，所以按块推进
+        while (m_iv_count > 0 && temp > 0)
         {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-        }
-        else
-        {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - bytes_have_send;
+            if (temp >= (int)m_iv[0].iov_len)
+            {
+                temp -= m_iv[0].iov_len;
+                m_iv[0] = m_iv[1];
+                m_iv_count--;
+            }
+            else
+            {
+                m_iv[0].iov_base = (char *)m_iv[0].iov_base + temp;
+                m_iv[0].iov_len -= temp;
+                temp = 0;
+            }
         }
 
+        //多段响应的一段发完了，接着准备下一段
+        if (m_multipart && m_iv_count == 0 && m_send_left == 0 && m_range_next <= m_range_count)
+            next_part();
+
         if (bytes_to_send <= 0)
         {
             unmap();
@@ -607,26 +917,34 @@ bool http_conn::add_response(const char *format, ...)
     m_write_idx += len;
     va_end(arg_list);
     LOG_INFO("request:%s", m_write_buf);
-    Log::get_instance()->flush();
     return true;
 }
 bool http_conn::add_status_line(int status, const char *title)
 {
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
-bool http_conn::add_headers(int content_len)
+bool http_conn::add_headers(off_t content_len)
+{
+    return add_content_length(content_len) && add_linger() && add_blank_line();
+}
+bool http_conn::add_content_length(off_t content_len)
 {
-    add_content_length(content_len);
-    add_linger();
-    add_blank_line();
+    return add_response("Content-Length:%lld\r\n", (long long)content_len);
 }
-bool http_conn::add_content_length(int content_len)
+//文件响应都带上：支持范围请求，以及If-Range要比较的修改时间；发的是压缩版本时带上编码
+bool http_conn::add_file_headers()
 {
-    return add_response("Content-Length:%d\r\n", content_len);
+    char date[64];
+    format_http_date(m_file_stat.st_mtime, date, sizeof(date));
+    if (!add_response("Accept-Ranges:bytes\r\nLast-Modified:%s\r\n", date))
+        return false;
+    if (m_encoding != ENCODING_IDENTITY && !add_response("Content-Encoding:%s\r\n", encoding_name(m_encoding)))
+        return false;
+    return !m_vary || add_response("Vary:Accept-Encoding\r\n");
 }
 bool http_conn::add_content_type()
 {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    return add_response("Content-Type:%s\r\n", m_mime);
 }
 bool http_conn::add_linger()
 {
@@ -670,15 +988,43 @@ bool http_conn::process_write(HTTP_CODE ret)
     }
     case FILE_REQUEST:
     {
-        add_status_line(200, ok_200_title);
+        if (!m_response)
+        {
+            add_status_line(200, ok_200_title);
+            add_file_headers();
+            add_content_type();
+            if (m_file_stat.st_size != 0)
+            {
+                add_headers(m_file_stat.st_size);
+                //小文件把响应头和内容拼好放进响应缓存
+                m_response = response_cache::get_instance()->insert(m_real_file + strlen(doc_root), m_linger, m_encoding, m_write_buf, m_write_idx, m_file);
+            }
+        }
+        if (m_response)
+        {
+            m_iv[0].iov_base = m_response->data;
+            m_iv[0].iov_len = m_response->len;
+            m_iv_count = 1;
+            bytes_to_send = m_response->len;
+            return true;
+        }
         if (m_file_stat.st_size != 0)
         {
-            add_headers(m_file_stat.st_size);
             m_iv[0].iov_base = m_write_buf;
             m_iv[0].iov_len = m_write_idx;
-            m_iv[1].iov_base = m_file_address;
-            m_iv[1].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
+            m_iv_count = 1;
+            if (m_file_address)
+            {
+                m_iv[1].iov_base = m_file_address;
+                m_iv[1].iov_len = m_file_stat.st_size;
+                m_iv_count = 2;
+            }
+            else
+            {
+                //大文件在响应头之后从头sendfile
+                m_send_offset = 0;
+                m_send_left = m_file_stat.st_size;
+            }
             bytes_to_send = m_write_idx + m_file_stat.st_size;
             return true;
         }
@@ -689,6 +1035,54 @@ bool http_conn::process_write(HTTP_CODE ret)
             if (!add_content(ok_string))
                 return false;
         }
+        break;
+    }
+    case PARTIAL_REQUEST:
+    {
+        add_status_line(206, partial_206_title);
+        add_file_headers();
+        m_iv[0].iov_base = m_write_buf;
+        m_iv_count = 1;
+        if (m_range_count == 1)
+        {
+            //单段：响应头之后直接sendfile这一段
+            m_send_offset = m_ranges[0].start;
+            m_send_left = m_ranges[0].end - m_ranges[0].start + 1;
+            add_response("Content-Range:bytes %lld-%lld/%lld\r\nContent-Type:%s\r\n", (long long)m_ranges[0].start,
+                         (long long)m_ranges[0].end, (long long)m_file_stat.st_size, m_mime);
+            if (!add_headers(m_send_left))
+                return false;
+            m_iv[0].iov_len = m_write_idx;
+            bytes_to_send = m_write_idx + m_send_left;
+            return true;
+        }
+        //多段：multipart/byteranges，每段前面有分隔行和自己的Content-Type、Content-Range
+        //段头部发的时候才生成，这里先算一遍长度得到Content-Length
+        snprintf(m_boundary, sizeof(m_boundary), "%08x%08x", (unsigned)time(NULL), boundary_counter.fetch_add(1));
+        off_t body_len = 0;
+        for (int i = 0; i <= m_range_count; ++i)
+        {
+            body_len += format_part(m_part_buf, PART_HEADER_SIZE, i);
+            if (i < m_range_count)
+                body_len += m_ranges[i].end - m_ranges[i].start + 1;
+        }
+        add_response("Content-Type:multipart/byteranges; boundary=%s\r\n", m_boundary);
+        if (!add_headers(body_len))
+            return false;
+        m_iv[0].iov_len = m_write_idx;
+        m_multipart = true;
+        m_range_next = 0;
+        bytes_to_send = m_write_idx + body_len;
+        return true;
+    }
+    case RANGE_NOT_SATISFIABLE:
+    {
+        add_status_line(416, error_416_title);
+        add_response("Content-Range:bytes */%lld\r\n", (long long)m_file_stat.st_size);
+        add_headers(strlen(error_416_form));
+        if (!add_content(error_416_form))
+            return false;
+        break;
     }
     default:
         return false;
@@ -19,14 +19,22 @@
 #include <errno.h>
 #include <sys/wait.h>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <atomic>
 #include "../lock/locker.h"
 #include "../CGImysql/sql_connection_pool.h"
+#include "file_cache.h"
+#include "response_cache.h"
+#include "../timer/lst_timer.h"
 class http_conn
 {
 public:
     static const int FILENAME_LEN = 200;
     static const int READ_BUFFER_SIZE = 2048;
     static const int WRITE_BUFFER_SIZE = 1024;
+    static const int MAX_RANGES = 16;         //一个Range请求最多的段数，再多就当作没有Range
+    static const int PART_HEADER_SIZE = 256;  //多段响应中每段前面的分隔行和段头部的最大长度
+    static const int STREAM_WINDOW = 1 << 20; //没有映射在缓存里的大文件按这么大的窗口sendfile，并提前一个窗口预读
     enum METHOD
     {
         GET = 0,
@@ -54,7 +62,15 @@ public:
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
         INTERNAL_ERROR,
-        CLOSED_CONNECTION
+        CLOSED_CONNECTION,
+        PARTIAL_REQUEST,      //Range请求，回复206
+        RANGE_NOT_SATISFIABLE //Range中没有一段在文件范围内，回复416
+    };
+    //Range中的一段，[start, end]闭区间
+    struct byte_range
+    {
+        off_t start;
+        off_t end;
     };
     enum LINE_STATUS
     {
@@ -64,12 +80,17 @@ public:
     };
 
 public:
-    http_conn() {}
+    http_conn() : m_generation(0) {}
     ~http_conn() {}
 
 public:
     void init(int sockfd, const sockaddr_in &addr);
     void close_conn(bool real_close = true);
+    bool close_conn(unsigned generation);
+    unsigned get_generation() const
+    {
+        return m_generation;
+    }
     void process();
     bool read_once();
     bool write();
@@ -87,15 +108,21 @@ private:
     HTTP_CODE parse_headers(char *text);
     HTTP_CODE parse_content(char *text);
     HTTP_CODE do_request();
+    HTTP_CODE parse_range();
+    int parse_accept_encoding(const char *text);
+    bool if_range_match();
+    void next_part();
+    int format_part(char *buf, int size, int i);
     char *get_line() { return m_read_buf + m_start_line; };
     LINE_STATUS parse_line();
     void unmap();
     bool add_response(const char *format, ...);
     bool add_content(const char *content);
     bool add_status_line(int status, const char *title);
-    bool add_headers(int content_length);
+    bool add_headers(off_t content_length);
     bool add_content_type();
-    bool add_content_length(int content_length);
+    bool add_content_length(off_t content_length);
+    bool add_file_headers();
     bool add_linger();
     bool add_blank_line();
 
@@ -103,6 +130,7 @@ public:
     static int m_epollfd;
     static int m_user_count;
     MYSQL *mysql;
+    util_timer timer; //空闲超时定时器，只在主线程里操作
 
 private:
     int m_sockfd;
@@ -119,16 +147,34 @@ private:
     char *m_url;
     char *m_version;
     char *m_host;
+    char *m_range;    //Range头部的值，没有时为NULL
+    char *m_if_range; //If-Range头部的值，没有时为NULL
+    int m_accept_encoding; //Accept-Encoding中接受的压缩版本，CONTENT_ENCODING的位或
+    int m_encoding;        //这次发送的是哪个压缩版本，m_file就是那个版本的文件
+    bool m_vary;           //文件有压缩版本，响应要带Vary:Accept-Encoding
+    const char *m_mime;    //原文件的MIME类型，发压缩版本时也用它
     int m_content_length;
     bool m_linger;
+    file_entry *m_file; //目标文件在文件缓存中的项，发送期间持有一个引用
+    cached_response *m_response; //响应缓存中拼好的完整响应，发送期间持有一个引用
     char *m_file_address;
     struct stat m_file_stat;
     struct iovec m_iv[2];
     int m_iv_count;
+    byte_range m_ranges[MAX_RANGES]; //Range请求要发送的各段
+    int m_range_count;
+    int m_range_next;   //多段响应中下一个要准备的段，等于m_range_count时准备结束的分隔行
+    bool m_multipart;   //是否是multipart/byteranges的多段响应
+    char m_boundary[24]; //多段响应的分隔符
+    char m_part_buf[PART_HEADER_SIZE]; //正在发送的段前面的分隔行和段头部
+    off_t m_send_offset; //范围请求的文件内容用sendfile从这个偏移开始发
+    off_t m_send_left;   //当前这一段文件内容还没发的字节数
+    off_t m_readahead;   //已经让内核预读到的位置
     int cgi;        //是否启用的POST
     char *m_string; //存储请求头数据
-    int bytes_to_send;
-    int bytes_have_send;
+    off_t bytes_to_send;
+    off_t bytes_have_send;
+    std::atomic<unsigned> m_generation; //每关闭一次加一，用来让过期的定时器失效
 };
 
 #endif
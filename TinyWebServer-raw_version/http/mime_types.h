@@ -0,0 +1,108 @@
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+#include <string.h>
+
+//文件扩展名 -> MIME类型，文件加载进缓存时按扩展名查一次，存在file_entry里
+struct mime_type
+{
+    const char *ext;  //小写的扩展名，不带点
+    const char *type; //MIME类型
+};
+
+//按扩展名排好序，查找时二分
+constexpr mime_type mime_types[] = {
+    {"avif", "image/avif"},
+    {"bmp", "image/bmp"},
+    {"css", "text/css; charset=utf-8"},
+    {"csv", "text/csv; charset=utf-8"},
+    {"gif", "image/gif"},
+    {"gz", "application/gzip"},
+    {"htm", "text/html; charset=utf-8"},
+    {"html", "text/html; charset=utf-8"},
+    {"ico", "image/x-icon"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"md", "text/markdown; charset=utf-8"},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {"mp3", "audio/mpeg"},
+    {"mp4", "video/mp4"},
+    {"ogg", "audio/ogg"},
+    {"otf", "font/otf"},
+    {"pdf", "application/pdf"},
+    {"png", "image/png"},
+    {"svg", "image/svg+xml"},
+    {"tar", "application/x-tar"},
+    {"ttf", "font/ttf"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"wasm", "application/wasm"},
+    {"wav", "audio/wav"},
+    {"webm", "video/webm"},
+    {"webp", "image/webp"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"xml", "application/xml"},
+    {"zip", "application/zip"},
+};
+
+//没有扩展名或者不认识的扩展名，让浏览器当成二进制下载，不去猜
+static const char *const DEFAULT_MIME_TYPE = "application/octet-stream";
+
+constexpr int MIME_TYPE_COUNT = sizeof(mime_types) / sizeof(mime_types[0]);
+constexpr int MIME_EXT_MAX = 8; //最长的扩展名加上结尾的'\0'
+
+//下面几个都写成递归的，C++11的constexpr函数里不能有循环
+constexpr int mime_ext_compare(const char *a, const char *b)
+{
+    return (*a && *a == *b) ? mime_ext_compare(a + 1, b + 1) : (unsigned char)*a - (unsigned char)*b;
+}
+constexpr bool mime_ext_valid(const char *ext, int len)
+{
+    return *ext == '\0' ? len < MIME_EXT_MAX : !(*ext >= 'A' && *ext <= 'Z') && mime_ext_valid(ext + 1, len + 1);
+}
+
+//编译期检查表是按扩展名严格递增的，扩展名都是小写并且不超过MIME_EXT_MAX，否则二分会找错
+constexpr bool mime_types_valid(int i)
+{
+    return i == MIME_TYPE_COUNT ||
+           (mime_ext_valid(mime_types[i].ext, 0) &&
+            (i == 0 || mime_ext_compare(mime_types[i - 1].ext, mime_types[i].ext) < 0) &&
+            mime_types_valid(i + 1));
+}
+static_assert(mime_types_valid(0), "mime_types must be sorted by lowercase extension");
+
+//根据路径的扩展名查MIME类型，扩展名不区分大小写
+inline const char *lookup_mime_type(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/'))
+        return DEFAULT_MIME_TYPE;
+    char ext[MIME_EXT_MAX];
+    int len = 0;
+    for (const char *p = dot + 1; *p; ++p)
+    {
+        if (len == MIME_EXT_MAX - 1)
+            return DEFAULT_MIME_TYPE;
+        ext[len++] = (*p >= 'A' && *p <= 'Z') ? *p | 0x20 : *p;
+    }
+    ext[len] = '\0';
+
+    int lo = 0, hi = MIME_TYPE_COUNT - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        int cmp = mime_ext_compare(ext, mime_types[mid].ext);
+        if (cmp == 0)
+            return mime_types[mid].type;
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return DEFAULT_MIME_TYPE;
+}
+
+#endif
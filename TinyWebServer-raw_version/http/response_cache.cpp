@@ -0,0 +1,135 @@
+#include "response_cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+response_cache::response_cache() : m_max_bytes(0), m_bytes(0), m_hits(0), m_misses(0), m_evictions(0), m_last_stats(0) {}
+
+response_cache::~response_cache()
+{
+    m_lock.lock();
+    while (!m_lru.empty())
+    {
+        remove(m_lru.back());
+    }
+    m_lock.unlock();
+}
+
+void response_cache::init(long max_bytes)
+{
+    m_max_bytes = max_bytes;
+    m_last_stats = time(NULL);
+}
+
+bool response_cache::stats_due(time_t now)
+{
+    long last = m_last_stats;
+    return now - last >= STATS_INTERVAL && m_last_stats.compare_exchange_strong(last, now);
+}
+
+//同一个路径的两种响应：保持连接的和不保持连接的
+static std::string make_key(const char *url, bool linger, int encoding)
+{
+    std::string key(linger ? "K" : "C");
+    key += (char)('0' + encoding);
+    key += url;
+    return key;
+}
+
+cached_response *response_cache::acquire(const char *url, bool linger, int encoding)
+{
+    if (m_max_bytes <= 0)
+    {
+        return NULL;
+    }
+    std::string key = make_key(url, linger, encoding);
+
+    m_lock.lock();
+    std::unordered_map<std::string, cached_response *>::iterator it = m_responses.find(key);
+    if (it == m_responses.end())
+    {
+        m_lock.unlock();
+        m_misses++;
+        return NULL;
+    }
+    cached_response *response = it->second;
+    if (response->file->stale)
+    {
+        //文件已经被修改了，缓存的响应作废
+        remove(response);
+        m_lock.unlock();
+        m_misses++;
+        return NULL;
+    }
+    //移到LRU链表的最前面
+    m_lru.splice(m_lru.begin(), m_lru, response->lru);
+    response->ref++;
+    m_lock.unlock();
+    m_hits++;
+    return response;
+}
+
+cached_response *response_cache::insert(const char *url, bool linger, int encoding, const char *header, int header_len, file_entry *file)
+{
+    int len = header_len + file->st.st_size;
+    //已经过时的文件不缓存，包括加载期间文件变了、没有放进文件缓存的那一份
+    if (m_max_bytes <= 0 || file->st.st_size > MAX_FILE_SIZE || !file->address || len > m_max_bytes || file->stale)
+    {
+        return NULL;
+    }
+
+    //在锁外面把响应拼好
+    cached_response *response = new cached_response;
+    response->data = (char *)malloc(len);
+    if (!response->data)
+    {
+        delete response;
+        return NULL;
+    }
+    memcpy(response->data, header, header_len);
+    memcpy(response->data + header_len, file->address, file->st.st_size);
+    response->len = len;
+    response->file = file;
+    file->ref++;                 //响应活着的时候，文件也要活着，才能判断它有没有被修改
+    response->key = make_key(url, linger, encoding);
+    response->ref = 2;           //缓存一个，调用者一个
+
+    m_lock.lock();
+    std::pair<std::unordered_map<std::string, cached_response *>::iterator, bool> ret =
+        m_responses.insert(std::make_pair(response->key, response));
+    if (!ret.second)
+    {
+        //别的线程已经放进去了，把已有的替换掉，旧的可能是文件修改之前的
+        remove(ret.first->second);
+        m_responses.insert(std::make_pair(response->key, response));
+    }
+    m_lru.push_front(response);
+    response->lru = m_lru.begin();
+    m_bytes += len;
+
+    //超出大小了，从链表尾部开始淘汰
+    while (m_bytes > m_max_bytes && m_lru.back() != response)
+    {
+        remove(m_lru.back());
+        m_evictions++;
+    }
+    m_lock.unlock();
+    return response;
+}
+
+void response_cache::remove(cached_response *response)
+{
+    m_responses.erase(response->key);
+    m_lru.erase(response->lru);
+    m_bytes -= response->len;
+    release(response);
+}
+
+void response_cache::release(cached_response *response)
+{
+    if (--response->ref == 0)
+    {
+        file_cache::get_instance()->release(response->file);
+        free(response->data);
+        delete response;
+    }
+}
@@ -4,6 +4,7 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
 
 class sem
 {
@@ -34,6 +35,20 @@ public:
     {
         return sem_post(&m_sem) == 0;
     }
+    //最多等ms毫秒，超时返回false
+    bool timedwait(int ms)
+    {
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += ms / 1000;
+        t.tv_nsec += (ms % 1000) * 1000000L;
+        if (t.tv_nsec >= 1000000000L)
+        {
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000L;
+        }
+        return sem_timedwait(&m_sem, &t) == 0;
+    }
 
 private:
     sem_t m_sem;
@@ -56,6 +71,10 @@ public:
     {
         return pthread_mutex_lock(&m_mutex) == 0;
     }
+    bool trylock()
+    {
+        return pthread_mutex_trylock(&m_mutex) == 0;
+    }
     bool unlock()
     {
         return pthread_mutex_unlock(&m_mutex) == 0;
@@ -68,6 +87,36 @@ public:
 private:
     pthread_mutex_t m_mutex;
 };
+class rwlocker
+{
+public:
+    rwlocker()
+    {
+        if (pthread_rwlock_init(&m_rwlock, NULL) != 0)
+        {
+            throw std::exception();
+        }
+    }
+    ~rwlocker()
+    {
+        pthread_rwlock_destroy(&m_rwlock);
+    }
+    bool rdlock()
+    {
+        return pthread_rwlock_rdlock(&m_rwlock) == 0;
+    }
+    bool wrlock()
+    {
+        return pthread_rwlock_wrlock(&m_rwlock) == 0;
+    }
+    bool unlock()
+    {
+        return pthread_rwlock_unlock(&m_rwlock) == 0;
+    }
+
+private:
+    pthread_rwlock_t m_rwlock;
+};
 class cond
 {
 public:
@@ -1,52 +1,125 @@
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include "log.h"
 #include <pthread.h>
 using namespace std;
 
+//每个线程缓存当前这一秒格式化好的时间，同一秒内的日志不用再调localtime，localtime里有一把全局的锁
+struct log_clock
+{
+    time_t sec;
+    struct tm tm;
+    char text[32];
+};
+std::atomic<int> Log::m_level(LOG_LEVEL_DEBUG);
+
+static thread_local log_clock t_clock = {-1, {}, {0}};
+static thread_local log_buffer *t_buffer = NULL;
+
+static const char *level_names[] = {"[debug]:", "[info]:", "[warn]:", "[erro]:"};
+
+//异步时直接调用write_log的，先在调用者线程里格式化好，整行作为一个字符串参数放进记录
+static const log_site text_sites[] = {{0, "%s"}, {1, "%s"}, {2, "%s"}, {3, "%s"}};
+
+static const log_clock &log_time(time_t sec)
+{
+    if (sec != t_clock.sec)
+    {
+        localtime_r(&sec, &t_clock.tm);
+        //月、日、时、分、秒都不超过两位，转成unsigned char让编译器也知道text放得下
+        snprintf(t_clock.text, sizeof(t_clock.text), "%d-%02d-%02d %02d:%02d:%02d",
+                 t_clock.tm.tm_year + 1900, (unsigned char)(t_clock.tm.tm_mon + 1), (unsigned char)t_clock.tm.tm_mday,
+                 (unsigned char)t_clock.tm.tm_hour, (unsigned char)t_clock.tm.tm_min, (unsigned char)t_clock.tm.tm_sec);
+        t_clock.sec = sec;
+    }
+    return t_clock;
+}
+
 Log::Log()
 {
     m_count = 0;
     m_is_async = false;
+    m_fp = NULL;
+    m_file_buf = NULL;
+    m_file_name[0] = '\0';
+    m_rotate_pending = false;
+    m_compress = false;
+    m_buffers = NULL;
+    m_wakeup_pending = false;
+    m_thread_buf_size = 0;
+    m_out = NULL;
+    m_out_len = 0;
 }
 
 Log::~Log()
 {
+    m_mutex.lock();
+    if (m_is_async)
+    {
+        //把各线程缓冲区里剩下的写完
+        write_batch();
+    }
     if (m_fp != NULL)
     {
         fclose(m_fp);
+        m_fp = NULL;
     }
+    m_mutex.unlock();
 }
-//异步需要设置阻塞队列的长度，同步不需要设置
-bool Log::init(const char *file_name, int log_buf_size, int split_lines, int max_queue_size)
+//进程因为致命信号崩溃时，把缓冲区里还没写的日志写掉，再按默认处理方式结束进程
+static void crash_handler(int sig)
+{
+    Log::get_instance()->crash_flush();
+    raise(sig);
+}
+
+//只接管还是默认处理方式的信号，不覆盖程序自己设置的
+static void install_crash_handler()
 {
-    //如果设置了max_queue_size,则设置为异步
-    if (max_queue_size >= 1)
+    static const int fatal_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    for (size_t i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); ++i)
     {
-        m_is_async = true;
-        m_log_queue = new block_queue<string>(max_queue_size);
-        pthread_t tid;
-        //flush_log_thread为回调函数,这里表示创建线程异步写日志
-        pthread_create(&tid, NULL, flush_log_thread, NULL);
+        struct sigaction old;
+        if (sigaction(fatal_signals[i], NULL, &old) != 0 || old.sa_handler != SIG_DFL)
+            continue;
+        struct sigaction sa;
+        memset(&sa, '\0', sizeof(sa));
+        sa.sa_handler = crash_handler;
+        sa.sa_flags = SA_RESETHAND; //处理函数里再raise就是默认处理方式了
+        sigemptyset(&sa.sa_mask);
+        sigaction(fatal_signals[i], &sa, NULL);
     }
+}
 
+//异步需要设置每个线程缓冲区的大小，同步不需要设置
+bool Log::init(const char *file_name, int log_buf_size, int split_lines, int thread_buf_size, bool compress)
+{
     m_log_buf_size = log_buf_size;
-    m_buf = new char[m_log_buf_size];
-    memset(m_buf, '\0', m_log_buf_size);
     m_split_lines = split_lines;
 
     time_t t = time(NULL);
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
+    struct tm my_tm;
+    localtime_r(&t, &my_tm);
+
 
- 
     const char *p = strrchr(file_name, '/');
     char log_full_name[256] = {0};
 
     if (p == NULL)
     {
+        //换文件时要用到目录和文件名
+        dir_name[0] = '\0';
+        strcpy(log_name, file_name);
         snprintf(log_full_name, 255, "%d_%02d_%02d_%s", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, file_name);
     }
     else
@@ -57,107 +130,580 @@ bool Log::init(const char *file_name, int log_buf_size, int split_lines, int max
     }
 
     m_today = my_tm.tm_mday;
+    m_compress = compress;
+
+    //如果设置了thread_buf_size,则设置为异步
+    if (thread_buf_size >= 1)
+    {
+        //环形缓冲的大小取2的幂，下标直接用位与
+        m_thread_buf_size = 4096;
+        while (m_thread_buf_size < (unsigned long)thread_buf_size)
+            m_thread_buf_size <<= 1;
+        m_out = new char[OUT_BUF_SIZE];
+        m_is_async = true;
+    }
 
-    m_fp = fopen(log_full_name, "a");
+    m_fp = open_file(log_full_name, m_file_buf);
     if (m_fp == NULL)
     {
         return false;
     }
+    strcpy(m_file_name, log_full_name);
 
+    //flush_log_thread为回调函数,这里表示创建线程按时间间隔写日志，同步异步都要
+    pthread_t tid;
+    pthread_create(&tid, NULL, flush_log_thread, NULL);
+    pthread_detach(tid);
+    //换下来的旧文件由另一个低优先级的线程关闭和压缩
+    pthread_create(&tid, NULL, retire_log_thread, NULL);
+    pthread_detach(tid);
+    install_crash_handler();
     return true;
 }
 
+//打开日志文件，同步时换上大一点的缓冲区，攒够了才写
+FILE *Log::open_file(const char *name, char *&file_buf)
+{
+    file_buf = NULL;
+    FILE *fp = fopen(name, "a");
+    if (fp == NULL)
+        return NULL;
+    if (!m_is_async)
+    {
+        file_buf = new char[FILE_BUF_SIZE];
+        setvbuf(fp, file_buf, _IOFBF, FILE_BUF_SIZE);
+    }
+    return fp;
+}
+
+//当前线程的缓冲区，线程第一次写日志时分配并登记，之后不用再加锁
+log_buffer *Log::get_buffer()
+{
+    if (t_buffer)
+        return t_buffer;
+    log_buffer *buf = new log_buffer;
+    buf->line = new char[m_log_buf_size];
+    buf->ring = NULL;
+    buf->size = 0;
+    buf->head = 0;
+    buf->tail = 0;
+    buf->dropped = 0;
+    if (m_is_async)
+    {
+        buf->size = m_thread_buf_size;
+        buf->ring = new char[buf->size];
+    }
+    m_mutex.lock();
+    buf->next = m_buffers.load(std::memory_order_relaxed);
+    m_buffers.store(buf, std::memory_order_release);
+    m_mutex.unlock();
+    t_buffer = buf;
+    return buf;
+}
+
+//在本线程的环形缓冲里占一块size字节的地方放记录，只有本线程写head，所以不用加锁
+//到末尾放不下时末尾那段空着，从头放；放不下时丢掉这条日志并计数，不能让处理请求的线程等着写文件
+char *Log::reserve(log_buffer *buf, size_t size, unsigned long &head)
+{
+    head = buf->head.load(std::memory_order_relaxed);
+    unsigned long tail = buf->tail.load(std::memory_order_acquire);
+    unsigned long pos = head & (buf->size - 1);
+    unsigned long skip = buf->size - pos < size ? buf->size - pos : 0;
+    if (size > buf->size / 2 || skip + size > buf->size - (head - tail))
+    {
+        buf->dropped.fetch_add(1, std::memory_order_relaxed);
+        wakeup();
+        return NULL;
+    }
+    if (skip)
+    {
+        //记录都是8字节对齐的，末尾至少还有放size的地方
+        ((log_record *)(buf->ring + pos))->size = 0;
+        head += skip;
+        pos = 0;
+    }
+    head += size;
+    return buf->ring + pos;
+}
+
+//记录写好了，让后台线程看得见；缓冲区过半或者是错误日志时叫醒后台线程，不用等到下一个时间间隔
+void Log::commit(log_buffer *buf, unsigned long head, bool urgent)
+{
+    buf->head.store(head, std::memory_order_release);
+    if (urgent || head - buf->tail.load(std::memory_order_relaxed) >= buf->size / 2)
+        wakeup();
+}
+
+//后台线程已经被叫过、还没开始写的时候不再叫，sem_post在有线程等着时要进内核
+void Log::wakeup()
+{
+    if (!m_wakeup_pending.load(std::memory_order_relaxed) && !m_wakeup_pending.exchange(true, std::memory_order_acq_rel))
+        m_wakeup.post();
+}
+
 void Log::write_log(int level, const char *format, ...)
 {
+    if (level < 0 || level > 3)
+        level = 1;
+    if (!enabled(level))
+        return;
+    //格式化到本线程自己的缓冲区里，不用加锁
+    log_buffer *buf = get_buffer();
+    char *line = buf->line;
+    va_list valst;
+
+    if (m_is_async)  // 异步，格式化好的内容作为一个字符串放进本线程的缓冲区，时间等由后台线程加上
+    {
+        va_start(valst, format);
+        int m = vsnprintf(line, m_log_buf_size, format, valst);
+        va_end(valst);
+        uint32_t len = m < 0 ? 0 : (m < m_log_buf_size ? m : m_log_buf_size - 1);
+        //不经过write_record，整行不受LOG_MAX_STRING的限制
+        size_t size = (sizeof(log_record) + 1 + sizeof(len) + len + 7) & ~(size_t)7;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        unsigned long head;
+        log_record *record = (log_record *)reserve(buf, size, head);
+        if (!record)
+            return;
+        record->size = size;
+        record->argc = 1;
+        record->site = &text_sites[level];
+        record->time_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        char *arg = (char *)(record + 1);
+        *arg = LOG_ARG_STRING;
+        memcpy(arg + 1, &len, sizeof(len));
+        memcpy(arg + 1 + sizeof(len), line, len);
+        commit(buf, head, level >= ERROR_LEVEL);
+        return;
+    }
+
     struct timeval now = {0, 0};
     gettimeofday(&now, NULL);
-    time_t t = now.tv_sec;
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
-    char s[16] = {0};
-    switch (level)
-    {
-    case 0:
-        strcpy(s, "[debug]:");
-        break;
-    case 1:
-        strcpy(s, "[info]:");
-        break;
-    case 2:
-        strcpy(s, "[warn]:");
-        break;
-    case 3:
-        strcpy(s, "[erro]:");
-        break;
-    default:
-        strcpy(s, "[info]:");
-        break;
-    }
-    //写入一个log，对m_count++, m_split_lines最大行数
+    const log_clock &clock = log_time(now.tv_sec);
+
+    //写入的具体时间内容格式
+    int n = snprintf(line, 48, "%s.%06ld %s ", clock.text, (long)now.tv_usec, level_names[level]);
+
+    va_start(valst, format);
+    int m = vsnprintf(line + n, m_log_buf_size - n - 1, format, valst);
+    va_end(valst);
+    //太长的截断，留出'\n'和'\0'的位置
+    if (m < 0)
+        m = 0;
+    if (m > m_log_buf_size - n - 2)
+        m = m_log_buf_size - n - 2;
+    line[n + m] = '\n';
+    line[n + m + 1] = '\0';
+
+    // 同步，写进文件的stdio缓冲区，缓冲区满了、后台线程定时或者是错误日志时才真正写文件
     m_mutex.lock();
+    //写入一个log，对m_count++, m_split_lines最大行数
     m_count++;
+    if (m_today != clock.tm.tm_mday || m_count % m_split_lines == 0) //everyday log
+        split_log(clock.tm);
+    if (m_fp != NULL)
+    {
+        fputs(line, m_fp);
+        if (level >= ERROR_LEVEL)
+            fflush(m_fp);
+    }
+    m_mutex.unlock();
+}
+
+//换一个新的日志文件：换天了用新一天的文件名，否则在文件名后面加上第几个
+//异步时本来就在后台线程里，直接换；同步时只记下新文件名，由后台线程去换，写日志的线程不等文件操作，换好之前的几行还写在旧文件里
+void Log::split_log(const struct tm &my_tm)
+{
+    char tail[16] = {0};
+
+    snprintf(tail, 16, "%d_%02d_%02d_", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday);
 
-    if (m_today != my_tm.tm_mday || m_count % m_split_lines == 0) //everyday log
+    if (m_today != my_tm.tm_mday)
     {
-        
-        char new_log[256] = {0};
-        fflush(m_fp);
-        fclose(m_fp);
-        char tail[16] = {0};
-       
-        snprintf(tail, 16, "%d_%02d_%02d_", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday);
-       
-        if (m_today != my_tm.tm_mday)
+        snprintf(m_next_name, 255, "%s%s%s", dir_name, tail, log_name);
+        m_today = my_tm.tm_mday;
+        m_count = 0;
+    }
+    else
+    {
+        snprintf(m_next_name, 255, "%s%s%s.%lld", dir_name, tail, log_name, m_count / m_split_lines);
+    }
+
+    if (m_is_async)
+    {
+        swap_file();
+    }
+    else
+    {
+        //不叫醒后台线程，叫醒时它可能马上抢占写日志的线程，文件操作又算到了请求的延迟里；最多晚FLUSH_INTERVAL_MS换
+        //这期间又到了分文件的行数时只换到最新的那个文件名，所以同步时每个文件的行数是大概的
+        m_rotate_pending = true;
+    }
+}
+
+//异步时后台线程换文件：先打开新文件，打开了才换下旧文件，打不开就接着写旧文件，调用前要加m_mutex
+void Log::swap_file()
+{
+    char *file_buf;
+    FILE *fp = open_file(m_next_name, file_buf);
+    if (fp == NULL)
+        return;
+    retire(m_fp, m_file_buf, m_file_name);
+    m_fp = fp;
+    m_file_buf = file_buf;
+    strcpy(m_file_name, m_next_name);
+}
+
+//同步时后台线程换文件：打开新文件时不拿锁，拿锁只是换一下文件指针，写日志的线程最多等这一下
+void Log::rotate()
+{
+    char name[256];
+    m_mutex.lock();
+    bool pending = m_rotate_pending;
+    strcpy(name, m_next_name);
+    m_mutex.unlock();
+    if (!pending)
+        return;
+
+    char *file_buf;
+    FILE *fp = open_file(name, file_buf);
+
+    m_mutex.lock();
+    //打开期间又要换下一个文件的话，留到下一次
+    if (strcmp(name, m_next_name) == 0)
+        m_rotate_pending = false;
+    FILE *old_fp = m_fp;
+    char *old_buf = m_file_buf;
+    char old_name[256];
+    strcpy(old_name, m_file_name);
+    if (fp != NULL)
+    {
+        m_fp = fp;
+        m_file_buf = file_buf;
+        strcpy(m_file_name, name);
+    }
+    m_mutex.unlock();
+
+    if (fp != NULL)
+        retire(old_fp, old_buf, old_name);
+}
+
+//把换下来的旧文件交给retire_loop
+void Log::retire(FILE *fp, char *file_buf, const char *name)
+{
+    retired_file file = {fp, file_buf, name};
+    m_retired_mutex.lock();
+    m_retired.push_back(file);
+    m_retired_mutex.unlock();
+    m_retired_sem.post();
+}
+
+//和compress_root.sh一样用命令行的gzip压缩，压缩好后gzip会删掉原文件
+//不加-f：重启后同名的文件再换下来时不覆盖以前压缩好的，留着不压缩；标准输入换成/dev/null，gzip不会停下来问要不要覆盖
+static void compress_file(const char *name)
+{
+    char *argv[] = {(char *)"gzip", (char *)"-q", (char *)name, NULL};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    pid_t pid;
+    int ret = posix_spawnp(&pid, "gzip", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (ret != 0)
+        return;
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+}
+
+//关闭旧文件的线程：fclose要把同步时stdio缓冲区里剩下的写进去，压缩更慢，都放在SCHED_IDLE的线程里，不和处理请求的线程抢CPU
+void Log::retire_loop()
+{
+    struct sched_param param;
+    param.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    while (true)
+    {
+        m_retired_sem.wait();
+        m_retired_mutex.lock();
+        if (m_retired.empty())
         {
-            snprintf(new_log, 255, "%s%s%s", dir_name, tail, log_name);
-            m_today = my_tm.tm_mday;
-            m_count = 0;
+            m_retired_mutex.unlock();
+            continue;
         }
-        else
+        retired_file file = m_retired.front();
+        m_retired.pop_front();
+        m_retired_mutex.unlock();
+
+        fclose(file.fp);
+        delete[] file.file_buf;
+        if (m_compress)
+            compress_file(file.name.c_str());
+    }
+}
+
+//把iov中的数据全部写进fd，处理只写了一部分的情况
+static void write_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0)
         {
-            snprintf(new_log, 255, "%s%s%s.%lld", dir_name, tail, log_name, m_count / m_split_lines);
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (count > 0 && n >= (ssize_t)iov->iov_len)
+        {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
         }
-        m_fp = fopen(new_log, "a");
     }
- 
-    m_mutex.unlock();
-
-    va_list valst;
-    va_start(valst, format);
+}
 
-    string log_str;
-    m_mutex.lock();
+//从记录里取出下一个参数
+struct log_arg
+{
+    int type;
+    int64_t i;
+    double d;
+    const char *str;
+    uint32_t len;
+};
 
-    //写入的具体时间内容格式
-    int n = snprintf(m_buf, 48, "%d-%02d-%02d %02d:%02d:%02d.%06ld %s ",
-                     my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
-                     my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, now.tv_usec, s);
-    
-    int m = vsnprintf(m_buf + n, m_log_buf_size - 1, format, valst);
-    m_buf[n + m] = '\n';
-    m_buf[n + m + 1] = '\0';
-    log_str = m_buf;
+static const char *log_get_arg(const char *p, log_arg &arg)
+{
+    arg.type = *p++;
+    if (arg.type == LOG_ARG_STRING)
+    {
+        memcpy(&arg.len, p, sizeof(arg.len));
+        arg.str = p + sizeof(arg.len);
+        return arg.str + arg.len;
+    }
+    if (arg.type == LOG_ARG_DOUBLE)
+    {
+        memcpy(&arg.d, p, 8);
+        arg.i = (int64_t)arg.d;
+    }
+    else
+    {
+        memcpy(&arg.i, p, 8);
+        arg.d = arg.type == LOG_ARG_UINT ? (double)(uint64_t)arg.i : (double)arg.i;
+    }
+    return p + 8;
+}
 
-    m_mutex.unlock();
+//在后台线程里把一条记录格式化成一行文本，返回长度，一行最多size个字节
+//按格式串一个一个转换说明取参数，每个转换说明用参数实际存的类型单独调一次snprintf，所以长度修饰符写错了也不会读错
+int Log::format_record(const log_record *record, char *out, int size)
+{
+    const log_clock &clock = log_time(record->time_ns / 1000000000);
+    int level = record->site->level;
+    int n = snprintf(out, 48, "%s.%06ld %s ", clock.text, (long)(record->time_ns % 1000000000 / 1000),
+                     level_names[(level >= 0 && level <= 3) ? level : 1]);
 
-    if (m_is_async && !m_log_queue->full())  // 看是否是同步，如果是异步，则将这条日志字符串push到队列中，由线程去拿
+    char *p = out + n;
+    char *end = out + size - 1; //最后留给'\n'
+    const char *f = record->site->format;
+    const char *args = (const char *)(record + 1);
+    uint32_t argc = record->argc;
+    while (*f && p < end)
     {
-        m_log_queue->push(log_str);
+        if (*f != '%')
+        {
+            *p++ = *f++;
+            continue;
+        }
+        if (f[1] == '%')
+        {
+            *p++ = '%';
+            f += 2;
+            continue;
+        }
+
+        //%[标志][宽度][.精度][长度修饰]转换字符，长度修饰丢掉，按参数存的类型重新加
+        const char *start = f++;
+        f += strspn(f, "-+ #0");
+        f += strspn(f, "0123456789");
+        if (*f == '.')
+        {
+            ++f;
+            f += strspn(f, "0123456789");
+        }
+        int prefix = f - start;
+        f += strspn(f, "hlLqjzt");
+        char conv = *f;
+        if (conv == '\0' || prefix > 16)
+            break;
+        ++f;
+
+        char spec[24];
+        memcpy(spec, start, prefix);
+        int room = end - p;
+        int w = 0;
+        if (argc == 0)
+        {
+            w = snprintf(p, room + 1, "%s", "(missing)");
+        }
+        else
+        {
+            --argc;
+            log_arg arg;
+            args = log_get_arg(args, arg);
+            if (arg.type == LOG_ARG_STRING)
+            {
+                //字符串在记录里没有'\0'，用精度限制长度；本来就有精度的取小的那个
+                const char *dot = (const char *)memchr(start, '.', prefix);
+                int len = arg.len;
+                if (dot && atoi(dot + 1) < len)
+                    len = atoi(dot + 1);
+                int flags_width = dot ? dot - start : prefix;
+                memcpy(spec, start, flags_width);
+                strcpy(spec + flags_width, ".*s");
+                w = snprintf(p, room + 1, spec, len, arg.str);
+            }
+            else if (conv == 'f' || conv == 'F' || conv == 'e' || conv == 'E' || conv == 'g' || conv == 'G' || conv == 'a' || conv == 'A')
+            {
+                spec[prefix] = conv;
+                spec[prefix + 1] = '\0';
+                w = snprintf(p, room + 1, spec, arg.d);
+            }
+            else if (conv == 'p')
+            {
+                w = snprintf(p, room + 1, "%p", (void *)(uintptr_t)arg.i);
+            }
+            else if (conv == 'c')
+            {
+                spec[prefix] = 'c';
+                spec[prefix + 1] = '\0';
+                w = snprintf(p, room + 1, spec, (int)arg.i);
+            }
+            else
+            {
+                //整数都按long long格式化，%s对应的是数的话按数打出来
+                if (conv == 's')
+                    conv = arg.type == LOG_ARG_UINT ? 'u' : 'd';
+                spec[prefix] = 'l';
+                spec[prefix + 1] = 'l';
+                spec[prefix + 2] = conv;
+                spec[prefix + 3] = '\0';
+                w = snprintf(p, room + 1, spec, (long long)arg.i);
+            }
+        }
+        if (w < 0)
+            w = 0;
+        p += w < room ? w : room;
     }
-    else                                     // 如果是同步，直接在这里就将这条日志字符串写进文件中去了
+    *p++ = '\n';
+    return p - out;
+}
+
+//把后台线程攒的文本写进文件
+void Log::write_out()
+{
+    if (m_out_len == 0)
+        return;
+    struct iovec iov;
+    iov.iov_base = m_out;
+    iov.iov_len = m_out_len;
+    write_all(fileno(m_fp), &iov, 1);
+    m_out_len = 0;
+}
+
+//把所有线程缓冲区里的记录格式化成文本，攒够OUT_BUF_SIZE或者都处理完了写一次文件，调用前要加m_mutex
+//按天和行数分文件在格式化每一行之前判断，一行不会拆到两个文件里
+void Log::write_batch()
+{
+    if (m_fp == NULL)
+        return;
+    for (log_buffer *buf = m_buffers.load(std::memory_order_acquire); buf; buf = buf->next)
     {
-        m_mutex.lock();
-        fputs(log_str.c_str(), m_fp);
-        m_mutex.unlock();
+        unsigned long dropped = buf->dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0)
+        {
+            if (OUT_BUF_SIZE - m_out_len < 128)
+                write_out();
+            m_out_len += snprintf(m_out + m_out_len, 128, "[warn]: %lu log lines dropped, log buffer full\n", dropped);
+        }
+
+        unsigned long head = buf->head.load(std::memory_order_acquire);
+        unsigned long tail = buf->tail.load(std::memory_order_relaxed);
+        while (tail != head)
+        {
+            unsigned long pos = tail & (buf->size - 1);
+            const log_record *record = (const log_record *)(buf->ring + pos);
+            if (record->size == 0)
+            {
+                //末尾空着的一段
+                tail += buf->size - pos;
+                continue;
+            }
+
+            const log_clock &clock = log_time(record->time_ns / 1000000000);
+            m_count++;
+            if (m_today != clock.tm.tm_mday || m_count % m_split_lines == 0)
+            {
+                write_out();
+                split_log(clock.tm);
+            }
+            if (OUT_BUF_SIZE - m_out_len < m_log_buf_size)
+                write_out();
+            m_out_len += format_record(record, m_out + m_out_len, m_log_buf_size);
+            tail += record->size;
+        }
+        buf->tail.store(tail, std::memory_order_release);
     }
+    write_out();
+}
 
-    va_end(valst);
+//后台线程：每隔FLUSH_INTERVAL_MS，或者有线程的缓冲区过半、有错误日志时，把所有线程的日志写进文件
+//同步时只是换文件和定时把stdio缓冲区里的写掉
+void Log::flush_loop()
+{
+    while (true)
+    {
+        m_wakeup.timedwait(FLUSH_INTERVAL_MS);
+        m_wakeup_pending.store(false, std::memory_order_release);
+        if (!m_is_async)
+            rotate();
+        flush();
+    }
 }
 
 void Log::flush(void)
 {
     m_mutex.lock();
-    //强制刷新写入流缓冲区
-    fflush(m_fp);
+    if (m_is_async)
+        write_batch();
+    else if (m_fp != NULL)
+        fflush(m_fp); //强制刷新写入流缓冲区
     m_mutex.unlock();
 }
+
+//崩溃的可能正是拿着锁的线程，或者后台线程正在写，所以只试着拿一会儿锁
+//格式化和fflush严格说都不是异步信号安全的，这里是进程结束前尽力而为
+void Log::crash_flush(void)
+{
+    struct timespec wait = {0, 1000000};
+    for (int i = 0; i < 100; ++i)
+    {
+        if (m_mutex.trylock())
+        {
+            if (m_is_async)
+                write_batch();
+            else if (m_fp != NULL)
+                fflush(m_fp);
+            m_mutex.unlock();
+            return;
+        }
+        nanosleep(&wait, NULL);
+    }
+}
@@ -4,15 +4,177 @@
 #include <stdio.h>
 #include <iostream>
 #include <string>
+#include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 #include <pthread.h>
-#include "block_queue.h"
+#include <atomic>
+#include <list>
+#include <type_traits>
+#include "../lock/locker.h"
 
 using namespace std;
 
+//日志级别
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+//编译期的最低级别，比如make LOG_MIN_LEVEL=1，低于它的LOG_XXX在编译时就整个去掉了，参数也不会求值
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+//每个线程自己的日志缓冲区
+//异步时是一个单生产者单消费者的环形缓冲：所在线程往里追加日志记录，不加锁；后台线程把记录格式化成文本写进文件
+//同步时没有环形缓冲，只用line格式化一行
+struct log_buffer
+{
+    char *line;                     //格式化一行日志用
+    char *ring;                     //环形缓冲，大小是2的幂
+    unsigned long size;
+    std::atomic<unsigned long> head;    //写到的位置，只有所在线程改，一直往上加，取模后才是下标
+    std::atomic<unsigned long> tail;    //后台线程已经处理完的位置，只有后台线程改
+    std::atomic<unsigned long> dropped; //环形缓冲满了丢掉的行数
+    log_buffer *next;               //所有线程的缓冲区串成一条链表，线程不会退出，所以只增不减
+};
+
+//一个写日志的地方，每个LOG_XXX展开成一个静态的log_site，记录里只存它的地址
+struct log_site
+{
+    int level;
+    const char *format;
+};
+
+//环形缓冲里的一条日志记录：记录头后面跟着参数，每个参数是一个字节的类型加上值
+//调用者只把参数原样拷进来，格式化成文本的事在后台线程做
+struct log_record
+{
+    uint32_t size;        //整条记录的字节数，按8字节对齐；0表示从这里到缓冲区末尾都空着，从头接着读
+    uint32_t argc;        //参数个数
+    const log_site *site;
+    int64_t time_ns;      //CLOCK_REALTIME的纳秒数
+};
+
+//记录中参数的类型
+enum LOG_ARG_TYPE
+{
+    LOG_ARG_INT = 0,      //有符号整数，存成int64_t
+    LOG_ARG_UINT,         //无符号整数，存成uint64_t
+    LOG_ARG_DOUBLE,
+    LOG_ARG_POINTER,
+    LOG_ARG_STRING        //字符串拷进记录里，调用返回后原来的内存可能就变了，比如inet_ntoa的静态缓冲区
+};
+
+static const int LOG_MAX_STRING = 1024; //记录里一个字符串参数最多拷这么多字节
+
+inline size_t log_string_length(const char *s)
+{
+    return s ? strnlen(s, LOG_MAX_STRING) : 6;
+}
+
+//每个参数在记录里占的字节数
+inline size_t log_arg_size(const char *s)
+{
+    return 1 + sizeof(uint32_t) + log_string_length(s);
+}
+inline size_t log_arg_size(char *s)
+{
+    return log_arg_size((const char *)s);
+}
+template <typename T>
+inline size_t log_arg_size(T)
+{
+    return 1 + 8;
+}
+inline size_t log_args_size()
+{
+    return 0;
+}
+template <typename T, typename... Args>
+inline size_t log_args_size(T value, Args... args)
+{
+    return log_arg_size(value) + log_args_size(args...);
+}
+
+//把参数拷进记录
+inline char *log_put_arg(char *p, const char *s)
+{
+    uint32_t len = log_string_length(s);
+    *p++ = LOG_ARG_STRING;
+    memcpy(p, &len, sizeof(len));
+    memcpy(p + sizeof(len), s ? s : "(null)", len);
+    return p + sizeof(len) + len;
+}
+inline char *log_put_arg(char *p, char *s)
+{
+    return log_put_arg(p, (const char *)s);
+}
+inline char *log_put_arg(char *p, const void *value)
+{
+    uint64_t v = (uint64_t)(uintptr_t)value;
+    *p++ = LOG_ARG_POINTER;
+    memcpy(p, &v, 8);
+    return p + 8;
+}
+template <typename T>
+inline char *log_put_arg(char *p, T *value)
+{
+    return log_put_arg(p, (const void *)value);
+}
+//按是不是浮点数分开实例化，整数的分支里不会出现指针或浮点数的转换
+template <typename T>
+inline char *log_put_number(char *p, T value, std::true_type)
+{
+    double v = (double)value;
+    *p++ = LOG_ARG_DOUBLE;
+    memcpy(p, &v, 8);
+    return p + 8;
+}
+template <typename T>
+inline char *log_put_number(char *p, T value, std::false_type)
+{
+    if (std::is_signed<T>::value || std::is_enum<T>::value)
+    {
+        int64_t v = (int64_t)value;
+        *p++ = LOG_ARG_INT;
+        memcpy(p, &v, 8);
+    }
+    else
+    {
+        uint64_t v = (uint64_t)value;
+        *p++ = LOG_ARG_UINT;
+        memcpy(p, &v, 8);
+    }
+    return p + 8;
+}
+template <typename T>
+inline char *log_put_arg(char *p, T value)
+{
+    return log_put_number(p, value, typename std::is_floating_point<T>::type());
+}
+inline char *log_put_args(char *p)
+{
+    return p;
+}
+template <typename T, typename... Args>
+inline char *log_put_args(char *p, T value, Args... args)
+{
+    return log_put_args(log_put_arg(p, value), args...);
+}
+
 class Log
 {
 public:
+    //什么时候把日志写进文件由日志模块自己决定，调用者不用也不应该在每条日志后面flush
+    //攒够一定的字节数、过了FLUSH_INTERVAL_MS、或者有LOG_ERROR时写文件；进程因为信号崩溃时把还没写的尽量写掉
+    static const int FLUSH_INTERVAL_MS = 500;   //后台线程最多隔这么久写一次文件
+    static const int OUT_BUF_SIZE = 256 * 1024; //异步时后台线程格式化好的文本攒到这么多写一次文件
+    static const int FILE_BUF_SIZE = 64 * 1024; //同步时日志文件的stdio缓冲区，满了才写文件
+    static const int ERROR_LEVEL = LOG_LEVEL_ERROR; //这个级别及以上的日志立刻写进文件
+
     //C++11以后,使用局部变量懒汉不用加锁
     static Log *get_instance()
     {
@@ -20,31 +182,82 @@ public:
         return &instance;
     }
 
-    static void *flush_log_thread(void *args)
+    static void *flush_log_thread(void *)
     {
-        Log::get_instance()->async_write_log();
+        Log::get_instance()->flush_loop();
+        return NULL;
+    }
+    static void *retire_log_thread(void *)
+    {
+        Log::get_instance()->retire_loop();
+        return NULL;
+    }
+    //可选择的参数有日志文件、一行日志的最大长度、最大行数以及每个线程的缓冲区大小
+    //thread_buf_size大于0时为异步，各线程只把日志记录放在自己的缓冲区里，由后台线程格式化后批量写进文件
+    //同步时调用者线程格式化并写进stdio缓冲区，后台线程只负责按时间间隔fflush
+    //按天、按行数换文件都由后台线程做，compress为true时换下来的旧文件再用gzip压缩
+    bool init(const char *file_name, int log_buf_size = 8192, int split_lines = 5000000, int thread_buf_size = 0, bool compress = false);
+
+    //运行时的最低级别，随时可以改，低于它的LOG_XXX只花一次relaxed的原子读
+    static void set_level(int level)
+    {
+        m_level.store(level, std::memory_order_relaxed);
+    }
+    static bool enabled(int level)
+    {
+        return level >= m_level.load(std::memory_order_relaxed);
+    }
+
+    //LOG_XXX调用的入口
+    //异步时只取一次时间，把记录头和参数拷进本线程的环形缓冲，不调用snprintf，也不加锁
+    template <typename... Args>
+    void write_record(const log_site *site, Args... args)
+    {
+        if (!m_is_async)
+        {
+            write_log(site->level, site->format, args...);
+            return;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        size_t size = (sizeof(log_record) + log_args_size(args...) + 7) & ~(size_t)7;
+        log_buffer *buf = get_buffer();
+        unsigned long head;
+        log_record *record = (log_record *)reserve(buf, size, head);
+        if (!record)
+            return;
+        record->size = size;
+        record->argc = sizeof...(args);
+        record->site = site;
+        record->time_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        log_put_args((char *)(record + 1), args...);
+        commit(buf, head, site->level >= ERROR_LEVEL);
     }
-    //可选择的参数有日志文件、日志缓冲区大小、最大行数以及最长日志条队列
-    bool init(const char *file_name, int log_buf_size = 8192, int split_lines = 5000000, int max_queue_size = 0);
 
     void write_log(int level, const char *format, ...);
 
+    //立刻把所有还没写的日志写进文件，正常运行时不需要调用
     void flush(void);
+    //在致命信号的处理函数里调用，拿不到锁就放弃，不会卡住
+    void crash_flush(void);
 
 private:
     Log();
     virtual ~Log();
-    void *async_write_log()
-    {
-        string single_log;
-        //从阻塞队列中取出一个日志string，写入文件
-        while (m_log_queue->pop(single_log))
-        {
-            m_mutex.lock();
-            fputs(single_log.c_str(), m_fp);
-            m_mutex.unlock();
-        }
-    }
+    log_buffer *get_buffer();
+    char *reserve(log_buffer *buf, size_t size, unsigned long &head);
+    void commit(log_buffer *buf, unsigned long head, bool urgent);
+    void wakeup();
+    void flush_loop();
+    void retire_loop();
+    FILE *open_file(const char *name, char *&file_buf);
+    void swap_file();
+    void rotate();
+    void retire(FILE *fp, char *file_buf, const char *name);
+    void write_batch();
+    int format_record(const log_record *record, char *out, int size);
+    void write_out();
+    void split_log(const struct tm &my_tm);
 
 private:
     char dir_name[128]; //路径名
@@ -54,16 +267,133 @@ private:
     long long m_count;  //日志行数记录
     int m_today;        //因为按天分类,记录当前时间是那一天
     FILE *m_fp;         //打开log的文件指针
-    char *m_buf;
-    block_queue<string> *m_log_queue; //阻塞队列
-    bool m_is_async;                  //是否同步标志位
-    locker m_mutex;
+    char *m_file_buf;   //同步时m_fp的缓冲区
+    char m_file_name[256]; //m_fp的文件名
+    char m_next_name[256]; //要换成的新文件名
+    bool m_rotate_pending; //同步时要换文件了，等后台线程去换
+    bool m_compress;       //换下来的旧文件是否压缩
+    unsigned long m_thread_buf_size; //每个线程环形缓冲的大小
+    std::atomic<log_buffer *> m_buffers; //所有线程的缓冲区
+    bool m_is_async;                 //是否异步
+    sem m_wakeup;                    //有线程的缓冲区过半了，叫醒后台线程
+    std::atomic<bool> m_wakeup_pending; //已经叫过后台线程了
+    char *m_out;                     //后台线程格式化好、还没写进文件的文本
+    int m_out_len;
+    locker m_mutex;                  //同步时保护写文件；异步时只有登记新线程的缓冲区和后台线程写文件时用，写日志记录不用
+
+    //换下来的旧文件，交给低优先级的线程去关闭和压缩
+    struct retired_file
+    {
+        FILE *fp;
+        char *file_buf;
+        std::string name;
+    };
+    std::list<retired_file> m_retired;
+    locker m_retired_mutex;
+    sem m_retired_sem;
+
+    static std::atomic<int> m_level; //运行时的最低级别，是静态成员，判断时不用先拿单例
 };
 
+//按调用点限制日志的频率，每个LOG_XXX_RATE展开成一个静态的log_rate
+//换秒和计数不是一起原子更新的，并发时一秒内可能多放过几条
+struct log_rate
+{
+    std::atomic<long> second; //当前计数的这一秒
+    std::atomic<int> count;   //这一秒里已经写了多少条
 
-#define LOG_DEBUG(format, ...) Log::get_instance()->write_log(0, format, ##__VA_ARGS__)
-#define LOG_INFO(format, ...) Log::get_instance()->write_log(1, format, ##__VA_ARGS__)
-#define LOG_WARN(format, ...) Log::get_instance()->write_log(2, format, ##__VA_ARGS__)
-#define LOG_ERROR(format, ...) Log::get_instance()->write_log(3, format, ##__VA_ARGS__)
+    bool allow(int per_second)
+    {
+        long now = time(NULL);
+        if (second.load(std::memory_order_relaxed) != now)
+        {
+            second.store(now, std::memory_order_relaxed);
+            count.store(0, std::memory_order_relaxed);
+        }
+        return count.fetch_add(1, std::memory_order_relaxed) < per_second;
+    }
+};
+
+//运行时的级别检查；低于LOG_MIN_LEVEL的级别在下面用#if换成了空语句，不会走到这里
+#define LOG_ENABLED(level) Log::enabled(level)
+
+//format必须是字符串字面量，记录里只存它所在的log_site的地址
+#define LOG_SITE_WRITE(level, format, ...)                            \
+    do                                                                \
+    {                                                                 \
+        static const log_site log_site_ = {level, "" format};        \
+        Log::get_instance()->write_record(&log_site_, ##__VA_ARGS__); \
+    } while (0)
+
+#define LOG_WRITE(level, format, ...)                     \
+    do                                                    \
+    {                                                     \
+        if (LOG_ENABLED(level))                           \
+            LOG_SITE_WRITE(level, format, ##__VA_ARGS__); \
+    } while (0)
+
+//每个调用点每n次只写第1次，热路径上的日志用它抽样
+#define LOG_WRITE_EVERY_N(level, n, format, ...)                                                 \
+    do                                                                                           \
+    {                                                                                            \
+        static std::atomic<unsigned> log_count_(0);                                              \
+        if (LOG_ENABLED(level) && log_count_.fetch_add(1, std::memory_order_relaxed) % (n) == 0) \
+            LOG_SITE_WRITE(level, format, ##__VA_ARGS__);                                        \
+    } while (0)
+
+//每个调用点每秒最多写per_second条，多出来的丢掉
+#define LOG_WRITE_RATE(level, per_second, format, ...)         \
+    do                                                         \
+    {                                                          \
+        static log_rate log_rate_;                             \
+        if (LOG_ENABLED(level) && log_rate_.allow(per_second)) \
+            LOG_SITE_WRITE(level, format, ##__VA_ARGS__);      \
+    } while (0)
+
+//低于LOG_MIN_LEVEL的级别在预处理时就换成空语句：调用、静态的log_site、格式串都不会编译进去，参数也不会求值，和优化级别无关
+#define LOG_DISABLED(...) \
+    do                    \
+    {                     \
+    } while (0)
+
+#if LOG_LEVEL_DEBUG >= LOG_MIN_LEVEL
+#define LOG_DEBUG(format, ...) LOG_WRITE(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define LOG_DEBUG_EVERY_N(n, format, ...) LOG_WRITE_EVERY_N(LOG_LEVEL_DEBUG, n, format, ##__VA_ARGS__)
+#define LOG_DEBUG_RATE(per_second, format, ...) LOG_WRITE_RATE(LOG_LEVEL_DEBUG, per_second, format, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_DISABLED()
+#define LOG_DEBUG_EVERY_N(...) LOG_DISABLED()
+#define LOG_DEBUG_RATE(...) LOG_DISABLED()
+#endif
+
+#if LOG_LEVEL_INFO >= LOG_MIN_LEVEL
+#define LOG_INFO(format, ...) LOG_WRITE(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_INFO_EVERY_N(n, format, ...) LOG_WRITE_EVERY_N(LOG_LEVEL_INFO, n, format, ##__VA_ARGS__)
+#define LOG_INFO_RATE(per_second, format, ...) LOG_WRITE_RATE(LOG_LEVEL_INFO, per_second, format, ##__VA_ARGS__)
+#else
+#define LOG_INFO(...) LOG_DISABLED()
+#define LOG_INFO_EVERY_N(...) LOG_DISABLED()
+#define LOG_INFO_RATE(...) LOG_DISABLED()
+#endif
+
+#if LOG_LEVEL_WARN >= LOG_MIN_LEVEL
+#define LOG_WARN(format, ...) LOG_WRITE(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define LOG_WARN_EVERY_N(n, format, ...) LOG_WRITE_EVERY_N(LOG_LEVEL_WARN, n, format, ##__VA_ARGS__)
+#define LOG_WARN_RATE(per_second, format, ...) LOG_WRITE_RATE(LOG_LEVEL_WARN, per_second, format, ##__VA_ARGS__)
+#else
+#define LOG_WARN(...) LOG_DISABLED()
+#define LOG_WARN_EVERY_N(...) LOG_DISABLED()
+#define LOG_WARN_RATE(...) LOG_DISABLED()
+#endif
+
+#if LOG_LEVEL_ERROR >= LOG_MIN_LEVEL
+#define LOG_ERROR(format, ...) LOG_WRITE(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#define LOG_ERROR_EVERY_N(n, format, ...) LOG_WRITE_EVERY_N(LOG_LEVEL_ERROR, n, format, ##__VA_ARGS__)
+#define LOG_ERROR_RATE(per_second, format, ...) LOG_WRITE_RATE(LOG_LEVEL_ERROR, per_second, format, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(...) LOG_DISABLED()
+#define LOG_ERROR_EVERY_N(...) LOG_DISABLED()
+#define LOG_ERROR_RATE(...) LOG_DISABLED()
+#endif
 
 #endif
@@ -20,8 +20,8 @@
 #define MAX_EVENT_NUMBER 10000 //最大事件数
 #define TIMESLOT 5             //最小超时单位
 
-#define SYNLOG  //同步写日志
-//#define ASYNLOG //异步写日志
+//#define SYNLOG  //同步写日志
+#define ASYNLOG //异步写日志
 
 //#define listenfdET //边缘触发非阻塞
 #define listenfdLT //水平触发阻塞
@@ -30,10 +30,11 @@
 extern int addfd(int epollfd, int fd, bool one_shot);
 extern int remove(int epollfd, int fd);
 extern int setnonblocking(int fd);
+extern const char *doc_root;
 
 //设置定时器相关参数
 static int pipefd[2];
-static sort_timer_lst timer_lst;
+static time_wheel timer_wheel;
 static int epollfd = 0;
 
 //信号处理函数
@@ -58,22 +59,15 @@ void addsig(int sig, void(handler)(int), bool restart = true)
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-//定时处理任务，重新定时以不断触发SIGALRM信号
-void timer_handler()
-{
-    timer_lst.tick();
-    alarm(TIMESLOT);
-}
-
 //定时器回调函数，删除非活动连接在socket上的注册事件，并关闭
-void cb_func(client_data *user_data)
+//连接在定时器设置之后已经被工作线程关掉了的话，代数对不上，什么也不做
+void cb_func(http_conn *user_data)
 {
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
     assert(user_data);
-    close(user_data->sockfd);
-    http_conn::m_user_count--;
-    LOG_INFO("close fd %d", user_data->sockfd);
-    Log::get_instance()->flush();
+    if (user_data->close_conn(user_data->timer.generation))
+    {
+        LOG_INFO("close connection(%s)", inet_ntoa(user_data->get_address()->sin_addr));
+    }
 }
 
 void show_error(int connfd, const char *info)
@@ -83,14 +77,23 @@ void show_error(int connfd, const char *info)
     close(connfd);
 }
 
+//记下响应缓存的命中、未命中、淘汰次数和占用的字节数
+void log_cache_stats()
+{
+    //编译时去掉了INFO级别的话整个调用都没有，所以不用局部变量存单例
+    LOG_INFO("response cache: %lu hits, %lu misses, %lu evictions, %ld bytes",
+             response_cache::get_instance()->hits(), response_cache::get_instance()->misses(),
+             response_cache::get_instance()->evictions(), response_cache::get_instance()->bytes());
+}
+
 int main(int argc, char *argv[])
 {
 #ifdef ASYNLOG
-    Log::get_instance()->init("ServerLog", 2000, 800000, 8); //异步日志模型
+    Log::get_instance()->init("ServerLog", 2000, 800000, 256 * 1024, true); //异步日志模型，每个线程256KB的缓冲区，换下来的日志文件压缩
 #endif
 
 #ifdef SYNLOG
-    Log::get_instance()->init("ServerLog", 2000, 800000, 0); //同步日志模型
+    Log::get_instance()->init("ServerLog", 2000, 800000, 0, true); //同步日志模型，换下来的日志文件压缩
 #endif
 
     if (argc <= 1)
@@ -103,6 +106,14 @@ int main(int argc, char *argv[])
 
     addsig(SIGPIPE, SIG_IGN);
 
+    //初始化文件缓存，监听网站根目录下文件的变化
+    if (!file_cache::get_instance()->init(doc_root))
+    {
+        LOG_ERROR("%s", "file cache init failure");
+        return 1;
+    }
+    response_cache::get_instance()->init(16 * 1024 * 1024);
+
     //创建数据库连接池
     connection_pool *connPool = connection_pool::GetInstance();
     connPool->init("localhost", "root", "123456", "webserverdb", 3306, 8);
@@ -163,18 +174,13 @@ int main(int argc, char *argv[])
     setnonblocking(pipefd[1]);
     addfd(epollfd, pipefd[0], false);
 
-    addsig(SIGALRM, sig_handler, false);
     addsig(SIGTERM, sig_handler, false);
     bool stop_server = false;
 
-    client_data *users_timer = new client_data[MAX_FD];
-
-    bool timeout = false;
-    alarm(TIMESLOT);
-
     while (!stop_server)
     {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        //有定时器时最多等1秒，回来转时间轮，不再用alarm
+        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, timer_wheel.get_timeout());
         if (number < 0 && errno != EINTR)
         {
             LOG_ERROR("%s", "epoll failure");
@@ -205,17 +211,15 @@ int main(int argc, char *argv[])
                 }
                 users[connfd].init(connfd, client_address);
 
-                //初始化client_data数据
-                //创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
-                users_timer[connfd].address = client_address;
-                users_timer[connfd].sockfd = connfd;
-                util_timer *timer = new util_timer;
-                timer->user_data = &users_timer[connfd];
+                //设置连接自带的定时器：回调函数、超时时间和当前的代数
+                //这个槽上一个连接的定时器如果还挂在时间轮上，adjust_timer会把它挪到新的位置
+                util_timer *timer = &users[connfd].timer;
+                timer->user_data = &users[connfd];
                 timer->cb_func = cb_func;
+                timer->generation = users[connfd].get_generation();
                 time_t cur = time(NULL);
                 timer->expire = cur + 3 * TIMESLOT;
-                users_timer[connfd].timer = timer;
-                timer_lst.add_timer(timer);
+                timer_wheel.adjust_timer(timer);
 #endif
 
 #ifdef listenfdET
@@ -235,17 +239,15 @@ int main(int argc, char *argv[])
                     }
                     users[connfd].init(connfd, client_address);
 
-                    //初始化client_data数据
-                    //创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
-                    users_timer[connfd].address = client_address;
-                    users_timer[connfd].sockfd = connfd;
-                    util_timer *timer = new util_timer;
-                    timer->user_data = &users_timer[connfd];
+                    //设置连接自带的定时器：回调函数、超时时间和当前的代数
+                    //这个槽上一个连接的定时器如果还挂在时间轮上，adjust_timer会把它挪到新的位置
+                    util_timer *timer = &users[connfd].timer;
+                    timer->user_data = &users[connfd];
                     timer->cb_func = cb_func;
+                    timer->generation = users[connfd].get_generation();
                     time_t cur = time(NULL);
                     timer->expire = cur + 3 * TIMESLOT;
-                    users_timer[connfd].timer = timer;
-                    timer_lst.add_timer(timer);
+                    timer_wheel.adjust_timer(timer);
                 }
                 continue;
 #endif
@@ -254,13 +256,10 @@ int main(int argc, char *argv[])
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
             {
                 //服务器端关闭连接，移除对应的定时器
-                util_timer *timer = users_timer[sockfd].timer;
-                timer->cb_func(&users_timer[sockfd]);
+                util_timer *timer = &users[sockfd].timer;
+                timer->cb_func(&users[sockfd]);
 
-                if (timer)
-                {
-                    timer_lst.del_timer(timer);
-                }
+                timer_wheel.del_timer(timer);
             }
 
             //处理信号
@@ -283,11 +282,6 @@ int main(int argc, char *argv[])
                     {
                         switch (signals[i])
                         {
-                        case SIGALRM:
-                        {
-                            timeout = true;
-                            break;
-                        }
                         case SIGTERM:
                         {
                             stop_server = true;
@@ -300,75 +294,59 @@ int main(int argc, char *argv[])
             //处理客户连接上接收到的数据
             else if (events[i].events & EPOLLIN)
             {
-                util_timer *timer = users_timer[sockfd].timer;
+                util_timer *timer = &users[sockfd].timer;
                 if (users[sockfd].read_once())
                 {
                     LOG_INFO("deal with the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
-                    Log::get_instance()->flush();
                     //若监测到读事件，将该事件放入请求队列
                     pool->append(users + sockfd);
 
                     //若有数据传输，则将定时器往后延迟3个单位
-                    //并对新的定时器在链表上的位置进行调整
-                    if (timer)
-                    {
-                        time_t cur = time(NULL);
-                        timer->expire = cur + 3 * TIMESLOT;
-                        LOG_INFO("%s", "adjust timer once");
-                        Log::get_instance()->flush();
-                        timer_lst.adjust_timer(timer);
-                    }
+                    //并对新的定时器在时间轮上的位置进行调整
+                    time_t cur = time(NULL);
+                    timer->expire = cur + 3 * TIMESLOT;
+                    LOG_INFO_EVERY_N(100, "%s", "adjust timer once"); //每次读写都会调整，只抽样记录
+                    timer_wheel.adjust_timer(timer);
                 }
                 else
                 {
-                    timer->cb_func(&users_timer[sockfd]);
-                    if (timer)
-                    {
-                        timer_lst.del_timer(timer);
-                    }
+                    timer->cb_func(&users[sockfd]);
+                    timer_wheel.del_timer(timer);
                 }
             }
             else if (events[i].events & EPOLLOUT)
             {
-                util_timer *timer = users_timer[sockfd].timer;
+                util_timer *timer = &users[sockfd].timer;
                 if (users[sockfd].write())
                 {
                     LOG_INFO("send data to the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
-                    Log::get_instance()->flush();
 
                     //若有数据传输，则将定时器往后延迟3个单位
-                    //并对新的定时器在链表上的位置进行调整
-                    if (timer)
-                    {
-                        time_t cur = time(NULL);
-                        timer->expire = cur + 3 * TIMESLOT;
-                        LOG_INFO("%s", "adjust timer once");
-                        Log::get_instance()->flush();
-                        timer_lst.adjust_timer(timer);
-                    }
+                    //并对新的定时器在时间轮上的位置进行调整
+                    time_t cur = time(NULL);
+                    timer->expire = cur + 3 * TIMESLOT;
+                    LOG_INFO_EVERY_N(100, "%s", "adjust timer once"); //每次读写都会调整，只抽样记录
+                    timer_wheel.adjust_timer(timer);
                 }
                 else
                 {
-                    timer->cb_func(&users_timer[sockfd]);
-                    if (timer)
-                    {
-                        timer_lst.del_timer(timer);
-                    }
+                    timer->cb_func(&users[sockfd]);
+                    timer_wheel.del_timer(timer);
                 }
             }
         }
-        if (timeout)
-        {
-            timer_handler();
-            timeout = false;
-        }
+        timer_wheel.tick();
+
+        //每隔一段时间记一次响应缓存的统计信息
+        if (response_cache::get_instance()->stats_due(time(NULL)))
+            log_cache_stats();
     }
+    log_cache_stats();
     close(epollfd);
     close(listenfd);
     close(pipefd[1]);
     close(pipefd[0]);
     delete[] users;
-    delete[] users_timer;
     delete pool;
     return 0;
 }
@@ -1,13 +1,16 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
+#include <atomic>
 #include <cstdio>
+#include <stdint.h>
 #include <exception>
 #include <pthread.h>
 #include "../lock/locker.h"
+#include "ring_queue.h"
 #include "../CGImysql/sql_connection_pool.h"
 
+//每个工作线程一个请求队列，同一个连接的请求优先交给同一个线程，自己的队列空了就去偷别人的
 template <typename T>
 class threadpool
 {
@@ -18,17 +21,36 @@ public:
     bool append(T *request);
 
 private:
+    struct worker_queue
+    {
+        worker_queue(threadpool *p, int i, int capacity) : pool(p), index(i), queue(capacity), sleeping(false) {}
+
+        threadpool *pool;
+        int index;
+        ring_queue<T> queue;         //优先交给这个线程的请求
+        sem wakeup;                  //这个线程空闲时睡在这里
+        std::atomic<bool> sleeping;  //是否在睡眠，叫醒它的人负责改回false
+    };
+
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
     static void *worker(void *arg);
-    void run();
+    void run(worker_queue *q);
+    /*取一批任务，都没有时先自旋，仍然没有再睡在自己的信号量上*/
+    int take(worker_queue *q, T **requests);
+    /*先取自己队列的，没有就偷别人的*/
+    int grab(worker_queue *q, T **requests);
+    bool wake(worker_queue *q);
+
+    static const int BATCH_SIZE = 8;    //一次最多从自己队列取出的任务数
+    static const int STEAL_SIZE = 2;    //一次最多偷的任务数
+    static const int SPIN_COUNT = 128;  //睡眠前自旋检查的次数
 
 private:
     int m_thread_number;        //线程池中的线程数
     int m_max_requests;         //请求队列中允许的最大请求数
     pthread_t *m_threads;       //描述线程池的数组，其大小为m_thread_number
-    std::list<T *> m_workqueue; //请求队列
-    locker m_queuelocker;       //保护请求队列的互斥锁
-    sem m_queuestat;            //是否有任务需要处理
+    worker_queue **m_queues;    //每个工作线程的请求队列
+    std::atomic<int> m_idle;    //正在睡眠的线程数，为0时不用找人来偷任务
     bool m_stop;                //是否结束线程
     connection_pool *m_connPool;  //数据库
 };
@@ -37,6 +59,8 @@ threadpool<T>::threadpool(connection_pool *connPool, int thread_number,
                           int max_requests)
     : m_thread_number(thread_number),
       m_max_requests(max_requests),
+      m_queues(NULL),
+      m_idle(0),
       m_stop(false),
       m_threads(NULL),
       m_connPool(connPool) {
@@ -45,10 +69,14 @@ threadpool<T>::threadpool(connection_pool *connPool, int thread_number,
     m_threads = new pthread_t[m_thread_number];
     if (!m_threads)
         throw std::exception();
+    int capacity = max_requests / thread_number > 0 ? max_requests / thread_number : 1;
+    m_queues = new worker_queue *[m_thread_number];
+    for (int i = 0; i < thread_number; ++i)
+        m_queues[i] = new worker_queue(this, i, capacity);
     for (int i = 0; i < thread_number; ++i)
     {
         //printf("create the %dth thread\n",i);
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0)
+        if (pthread_create(m_threads + i, NULL, worker, m_queues[i]) != 0)
         {
             delete[] m_threads;
             throw std::exception();
@@ -65,49 +93,115 @@ threadpool<T>::~threadpool()
 {
     delete[] m_threads;
     m_stop = true;
+    //工作线程是分离的，可能还在用队列，m_queues不释放
 }
 template <typename T>
 bool threadpool<T>::append(T *request)
 {
-    m_queuelocker.lock();
-    if (m_workqueue.size() > m_max_requests)
+    //同一个连接优先交给同一个线程，满了再依次试后面的
+    int start = (int)(((uintptr_t)request / sizeof(T)) % m_thread_number);
+    worker_queue *q = NULL;
+    for (int i = 0; i < m_thread_number; i++)
     {
-        m_queuelocker.unlock();
+        worker_queue *candidate = m_queues[(start + i) % m_thread_number];
+        if (candidate->queue.push(request))
+        {
+            q = candidate;
+            break;
+        }
+    }
+    if (!q)
         return false;
+    //和take()中的fence配对，保证不会漏掉唤醒
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (wake(q))
+        return true;
+    //那个线程正忙，叫醒一个空闲的来偷
+    if (m_idle.load(std::memory_order_relaxed) > 0)
+    {
+        for (int i = 1; i < m_thread_number; i++)
+        {
+            if (wake(m_queues[(q->index + i) % m_thread_number]))
+                break;
+        }
     }
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
     return true;
 }
 template <typename T>
+bool threadpool<T>::wake(worker_queue *q)
+{
+    if (q->sleeping.load(std::memory_order_relaxed) && q->sleeping.exchange(false))
+    {
+        q->wakeup.post();
+        return true;
+    }
+    return false;
+}
+template <typename T>
 void *threadpool<T>::worker(void *arg)
 {
-    threadpool *pool = (threadpool *)arg;
-    pool->run();
-    return pool;
+    worker_queue *q = (worker_queue *)arg;
+    q->pool->run(q);
+    return q->pool;
+}
+template <typename T>
+int threadpool<T>::grab(worker_queue *q, T **requests)
+{
+    int n = q->queue.pop(requests, BATCH_SIZE);
+    if (n > 0)
+        return n;
+    for (int i = 1; i < m_thread_number; i++)
+    {
+        n = m_queues[(q->index + i) % m_thread_number]->queue.pop(requests, STEAL_SIZE);
+        if (n > 0)
+            return n;
+    }
+    return 0;
 }
 template <typename T>
-void threadpool<T>::run()
+int threadpool<T>::take(worker_queue *q, T **requests)
 {
     while (!m_stop)
     {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if (m_workqueue.empty())
+        int n = grab(q, requests);
+        if (n > 0)
+            return n;
+        for (int i = 0; i < SPIN_COUNT; i++)
         {
-            m_queuelocker.unlock();
-            continue;
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+            n = grab(q, requests);
+            if (n > 0)
+                return n;
         }
-        T *request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
-        if (!request)
-            continue;
+        //先登记要睡眠，再检查一次所有队列，append一定能看到有线程在睡
+        q->sleeping.store(true);
+        m_idle.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        n = grab(q, requests);
+        //没有任务就睡；拿到了任务但已经有人post过了，也要把那次post消耗掉
+        if (n == 0 || !q->sleeping.exchange(false))
+            q->wakeup.wait();
+        m_idle.fetch_sub(1);
+        if (n > 0)
+            return n;
+    }
+    return 0;
+}
+template <typename T>
+void threadpool<T>::run(worker_queue *q)
+{
+    T *requests[BATCH_SIZE];
+    while (!m_stop)
+    {
+        int n = take(q, requests);
+        for (int i = 0; i < n; i++)
+        {
+            connectionRAII mysqlcon(&requests[i]->mysql, m_connPool);
 
-        connectionRAII mysqlcon(&request->mysql, m_connPool);
-        
-        request->process();
+            requests[i]->process();
+        }
     }
 }
 #endif
@@ -4,14 +4,9 @@
 #include <time.h>
 #include "../log/log.h"
 
-class util_timer;
-struct client_data
-{
-    sockaddr_in address;
-    int sockfd;
-    util_timer *timer;
-};
+class http_conn;
 
+//定时器直接嵌在http_conn里，随连接槽一起分配，不再每个连接new一个
 class util_timer
 {
 public:
@@ -19,160 +14,183 @@ public:
 
 public:
     time_t expire;
-    void (*cb_func)(client_data *);
-    client_data *user_data;
-    util_timer *prev;
-    util_timer *next;
+    void (*cb_func)(http_conn *);
+    http_conn *user_data;
+    unsigned generation;   //定时器设置时连接的代数，连接已经被别处关闭时代数会变，回调就什么也不做
+    util_timer *prev;   //槽中的前一个定时器
+    util_timer *next;   //槽中的后一个定时器
 };
 
-class sort_timer_lst
+//分层时间轮：第0层256个槽，每槽1秒；往上每层64个槽，每槽是下一层转一圈的时间
+//定时器按超时时间直接挂到对应的槽上，增、删、调整都是O(1)；tick()只处理到期的槽，
+//远处的定时器在低一层转完一圈时才搬(cascade)到低一层
+//定时器由连接持有，时间轮只负责把它们串起来，不负责释放
+class time_wheel
 {
 public:
-    sort_timer_lst() : head(NULL), tail(NULL) {}
-    ~sort_timer_lst()
+    time_wheel() : cur_time(0), count(0)
     {
-        util_timer *tmp = head;
-        while (tmp)
+        //每个槽的头结点是哨兵，空槽的prev和next都指向自己
+        for (int i = 0; i < SLOTS_0; ++i)
         {
-            head = tmp->next;
-            delete tmp;
-            tmp = head;
+            slots0[i].prev = slots0[i].next = &slots0[i];
+        }
+        for (int i = 0; i < LEVELS - 1; ++i)
+        {
+            for (int j = 0; j < SLOTS; ++j)
+            {
+                slots[i][j].prev = slots[i][j].next = &slots[i][j];
+            }
         }
     }
     void add_timer(util_timer *timer)
     {
-        if (!timer)
+        if (!timer || timer->prev)
         {
             return;
         }
-        if (!head)
+        if (count == 0)
         {
-            head = tail = timer;
-            return;
-        }
-        if (timer->expire < head->expire)
-        {
-            timer->next = head;
-            head->prev = timer;
-            head = timer;
-            return;
+            cur_time = time(NULL);
         }
-        add_timer(timer, head);
+        link(timer);
+        count++;
     }
+    //超时时间延长或缩短都可以，不在时间轮上的就加进来
     void adjust_timer(util_timer *timer)
     {
         if (!timer)
         {
             return;
         }
-        util_timer *tmp = timer->next;
-        if (!tmp || (timer->expire < tmp->expire))
+        if (!timer->prev)
         {
+            add_timer(timer);
             return;
         }
-        if (timer == head)
-        {
-            head = head->next;
-            head->prev = NULL;
-            timer->next = NULL;
-            add_timer(timer, head);
-        }
-        else
-        {
-            timer->prev->next = timer->next;
-            timer->next->prev = timer->prev;
-            add_timer(timer, timer->next);
-        }
+        unlink(timer);
+        link(timer);
     }
     void del_timer(util_timer *timer)
     {
-        if (!timer)
-        {
-            return;
-        }
-        if ((timer == head) && (timer == tail))
-        {
-            delete timer;
-            head = NULL;
-            tail = NULL;
-            return;
-        }
-        if (timer == head)
+        if (!timer || !timer->prev)
         {
-            head = head->next;
-            head->prev = NULL;
-            delete timer;
             return;
         }
-        if (timer == tail)
-        {
-            tail = tail->prev;
-            tail->next = NULL;
-            delete timer;
-            return;
-        }
-        timer->prev->next = timer->next;
-        timer->next->prev = timer->prev;
-        delete timer;
+        unlink(timer);
+        count--;
     }
+    //每次epoll_wait返回后调用，处理从上次到现在到期的定时器
     void tick()
     {
-        if (!head)
+        time_t cur = time(NULL);
+        if (count == 0)
         {
+            cur_time = cur + 1;
             return;
         }
-        //printf( "timer tick\n" );
-        LOG_INFO("%s", "timer tick");
-        Log::get_instance()->flush();
-        time_t cur = time(NULL);
-        util_timer *tmp = head;
-        while (tmp)
+        int expired = 0;
+        while (cur_time <= cur)
         {
-            if (cur < tmp->expire)
+            int idx = cur_time & (SLOTS_0 - 1);
+            if (idx == 0)
             {
-                break;
+                //第0层转完一圈，把上一层当前槽搬下来，上一层也转完一圈就继续往上
+                for (int level = 1; level < LEVELS; ++level)
+                {
+                    int i = (cur_time >> (SLOT_BITS_0 + (level - 1) * SLOT_BITS)) & (SLOTS - 1);
+                    cascade(level, i);
+                    if (i != 0)
+                    {
+                        break;
+                    }
+                }
             }
-            tmp->cb_func(tmp->user_data);
-            head = tmp->next;
-            if (head)
+
+            util_timer *head = &slots0[idx];
+            while (head->next != head)
             {
-                head->prev = NULL;
+                util_timer *tmp = head->next;
+                unlink(tmp);
+                count--;
+                expired++;
+                tmp->cb_func(tmp->user_data);
             }
-            delete tmp;
-            tmp = head;
+            cur_time++;
         }
+        if (expired > 0)
+        {
+            LOG_INFO("timer tick, %d expired", expired);
+        }
+    }
+    //epoll_wait的超时时间(毫秒)，没有定时器时一直等
+    int get_timeout() const
+    {
+        return count == 0 ? -1 : 1000;
     }
 
 private:
-    void add_timer(util_timer *timer, util_timer *lst_head)
+    static const int LEVELS = 4;
+    static const int SLOT_BITS_0 = 8;
+    static const int SLOTS_0 = 1 << SLOT_BITS_0;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+
+    void link(util_timer *timer)
     {
-        util_timer *prev = lst_head;
-        util_timer *tmp = prev->next;
-        while (tmp)
+        time_t expire = timer->expire;
+        if (expire < cur_time)
+        {
+            expire = cur_time;
+        }
+        time_t delta = expire - cur_time;
+        util_timer *head;
+        if (delta < SLOTS_0)
+        {
+            head = &slots0[expire & (SLOTS_0 - 1)];
+        }
+        else
         {
-            if (timer->expire < tmp->expire)
+            int level = 1;
+            int shift = SLOT_BITS_0;
+            while (level < LEVELS - 1 && delta >= ((time_t)1 << (shift + SLOT_BITS)))
+            {
+                level++;
+                shift += SLOT_BITS;
+            }
+            if (delta >= ((time_t)1 << (shift + SLOT_BITS)))
             {
-                prev->next = timer;
-                timer->next = tmp;
-                tmp->prev = timer;
-                timer->prev = prev;
-                break;
+                expire = cur_time + ((time_t)1 << (shift + SLOT_BITS)) - 1;
             }
-            prev = tmp;
-            tmp = tmp->next;
+            head = &slots[level - 1][(expire >> shift) & (SLOTS - 1)];
         }
-        if (!tmp)
+        timer->next = head;
+        timer->prev = head->prev;
+        head->prev->next = timer;
+        head->prev = timer;
+    }
+    void unlink(util_timer *timer)
+    {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = timer->next = NULL;
+    }
+    void cascade(int level, int idx)
+    {
+        util_timer *head = &slots[level - 1][idx];
+        while (head->next != head)
         {
-            prev->next = timer;
-            timer->prev = prev;
-            timer->next = NULL;
-            tail = timer;
+            util_timer *tmp = head->next;
+            unlink(tmp);
+            link(tmp);
         }
     }
 
 private:
-    util_timer *head;
-    util_timer *tail;
+    util_timer slots0[SLOTS_0];
+    util_timer slots[LEVELS - 1][SLOTS];
+    time_t cur_time;   //下一个要处理的秒
+    int count;
 };
 
 #endif
@@ -0,0 +1,149 @@
+// crlf_scan.cpp里三种实现的性能对比：逐字节、SSE2、AVX2
+// 输入是几个浏览器和工具实际发出的请求头，一个read读进来的数据往往就是这么一段，按解析时的用法整段扫一遍
+//
+// 编译: g++ -std=c++17 -O2 crlf_scan_bench.cpp -o crlf_scan_bench
+// 运行: ./crlf_scan_bench [每个请求头扫描的次数]
+
+// 直接把实现包含进来，才能分别调用里面的static函数
+#include "../crlf_scan.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// 抓包得到的请求头，Cookie等隐私字段换成了同样长度的占位内容
+static const char* const requests[] = {
+    // Chrome
+    "GET /judge.html HTTP/1.1\r\n"
+    "Host: 192.168.1.10:9006\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "Cookie: session=xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx; theme=light; lang=zh-CN\r\n"
+    "\r\n",
+
+    // Firefox，带条件请求
+    "GET /images/test1.jpg HTTP/1.1\r\n"
+    "Host: 192.168.1.10:9006\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: zh-CN,zh;q=0.8,zh-TW;q=0.7,zh-HK;q=0.5,en-US;q=0.3,en;q=0.2\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://192.168.1.10:9006/judge.html\r\n"
+    "If-Modified-Since: Tue, 14 May 2024 08:12:33 GMT\r\n"
+    "If-None-Match: \"66431d21-1a2b3\"\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Priority: u=5, i\r\n"
+    "\r\n",
+
+    // Safari，POST登录表单，带请求体
+    "POST /2CGISQL.cgi HTTP/1.1\r\n"
+    "Host: 192.168.1.10:9006\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Origin: http://192.168.1.10:9006\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4.1 Safari/605.1.15\r\n"
+    "Referer: http://192.168.1.10:9006/log.html\r\n"
+    "Content-Length: 27\r\n"
+    "Accept-Language: zh-CN,zh-Hans;q=0.9\r\n"
+    "\r\n"
+    "user=wensong&password=1234a",
+
+    // curl，压测工具发的也是这种很短的请求头
+    "GET / HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+};
+
+static const int REQUEST_COUNT = sizeof(requests) / sizeof(requests[0]);
+static const int MAX_LINES = 256;   // 和解析时一样，一次最多记这么多个位置
+
+struct impl {
+    const char* name;
+    scan_func func;
+    bool supported;                  // 这台机器的CPU能不能跑
+};
+
+// 扫描结果累加到这里，免得编译器把整个循环优化掉
+static volatile long sink;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    long rounds = argc > 1 ? atol(argv[1]) : 2000000;
+    if (rounds <= 0) {
+        printf("usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+
+#ifdef CRLF_SCAN_X86
+    __builtin_cpu_init();
+#endif
+    impl impls[] = {
+        { "scalar", scan_crlf_scalar, true },
+#ifdef CRLF_SCAN_X86
+        { "sse2", scan_crlf_sse2, (bool)__builtin_cpu_supports("sse2") },
+        { "avx2", scan_crlf_avx2, (bool)__builtin_cpu_supports("avx2") },
+#endif
+    };
+    const int impl_count = sizeof(impls) / sizeof(impls[0]);
+
+    printf("default implementation: %s\n", scan_crlf_impl());
+    int out[MAX_LINES];
+    int expect[MAX_LINES];
+    for (int r = 0; r < REQUEST_COUNT; r++) {
+        const char* buf = requests[r];
+        int len = strlen(buf);
+        int expect_n = scan_crlf_scalar(buf, 0, len, expect, MAX_LINES);
+        printf("request %d: %d bytes, %d line breaks\n", r, len, expect_n);
+
+        for (int k = 0; k < impl_count; k++) {
+            if (!impls[k].supported) {
+                printf("  %-6s not supported by this CPU\n", impls[k].name);
+                continue;
+            }
+            // 先和逐字节的结果对一下，结果不对就不用看速度了
+            int n = impls[k].func(buf, 0, len, out, MAX_LINES);
+            if (n != expect_n || memcmp(out, expect, n * sizeof(int)) != 0) {
+                printf("  %-6s WRONG RESULT\n", impls[k].name);
+                return 1;
+            }
+
+            double start = now_sec();
+            for (long i = 0; i < rounds; i++) {
+                // 每次从不同的位置开始，编译器没法把循环提出去，同时也覆盖起点没对齐的情况
+                int begin = i & 3;
+                sink += impls[k].func(buf, begin, len, out, MAX_LINES);
+                sink += out[0];
+            }
+            double elapsed = now_sec() - start;
+            printf("  %-6s %7.1f ns/request  %6.2f GB/s\n", impls[k].name,
+                   elapsed / rounds * 1e9, (double)len * rounds / elapsed / 1e9);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,205 @@
+// 请求队列的性能对比：原来的 std::list + 互斥锁 + 信号量 和现在的无锁环形队列 ring_queue
+// 几个生产者线程不停地放任务，几个消费者线程不停地取，看每秒能过多少个任务
+//
+// 编译: g++ -std=c++17 -O2 -pthread queue_bench.cpp -o queue_bench
+// 运行: ./queue_bench [每个生产者放的任务数] [消费者线程数]
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <list>
+#include "../locker.h"
+#include "../ring_queue.h"
+
+struct task {
+    int value;
+};
+
+// 原来线程池里的请求队列，append和run里的加锁、判满、发信号的顺序原样保留
+class list_queue {
+public:
+    explicit list_queue(int max_requests) : m_max_requests(max_requests) {}
+
+    bool push(task* t) {
+        m_queuelocker.lock();
+        if ((int)m_workqueue.size() > m_max_requests) {
+            m_queuelocker.unlock();
+            return false;
+        }
+        m_workqueue.push_back(t);
+        m_queuelocker.unlock();
+        m_queuestat.post();
+        return true;
+    }
+
+    // 没有任务时堵塞在信号量上
+    int pop(task** items, int) {
+        m_queuestat.wait();
+        m_queuelocker.lock();
+        if (m_workqueue.empty()) {
+            m_queuelocker.unlock();
+            return 0;
+        }
+        items[0] = m_workqueue.front();
+        m_workqueue.pop_front();
+        m_queuelocker.unlock();
+        return 1;
+    }
+
+    // 结束时叫醒所有还睡在信号量上的消费者
+    void wake_all(int consumers) {
+        for (int i = 0; i < consumers; i++) {
+            m_queuestat.post();
+        }
+    }
+
+private:
+    int m_max_requests;
+    std :: list<task*> m_workqueue;
+    locker m_queuelocker;
+    sem m_queuestat;
+};
+
+// ring_queue没有睡眠，空了就让出CPU再试，和线程池里自旋的那一段一样
+class ring_adapter {
+public:
+    explicit ring_adapter(int max_requests) : m_queue(max_requests) {}
+
+    bool push(task* t) {
+        return m_queue.push(t);
+    }
+
+    int pop(task** items, int max) {
+        int n = m_queue.pop(items, max);
+        if (n == 0) {
+            sched_yield();
+        }
+        return n;
+    }
+
+    void wake_all(int) {}
+
+private:
+    ring_queue<task> m_queue;
+};
+
+static const int QUEUE_SIZE = 10000;  // 和threadpool默认的max_requests一样
+static const int BATCH_SIZE = 8;      // 和threadpool::BATCH_SIZE一样
+
+template<typename Q>
+struct bench_ctx {
+    Q* queue;
+    long per_producer;
+    task* tasks;                      // 每个生产者一段，放的是指针，不在计时里分配内存
+    std :: atomic<long> consumed;
+    std :: atomic<long> checksum;
+    long total;
+    int consumers;
+};
+
+template<typename Q>
+struct producer_arg {
+    bench_ctx<Q>* ctx;
+    int index;
+};
+
+template<typename Q>
+static void* producer(void* arg) {
+    producer_arg<Q>* a = (producer_arg<Q>*)arg;
+    bench_ctx<Q>* ctx = a -> ctx;
+    task* base = ctx -> tasks + a -> index * ctx -> per_producer;
+    for (long i = 0; i < ctx -> per_producer; i++) {
+        // 队列满了，reactor会关掉连接；这里只是等消费者腾出位置
+        while (!ctx -> queue -> push(base + i)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+template<typename Q>
+static void* consumer(void* arg) {
+    bench_ctx<Q>* ctx = (bench_ctx<Q>*)arg;
+    task* items[BATCH_SIZE];
+    long sum = 0;
+    while (ctx -> consumed.load(std :: memory_order_relaxed) < ctx -> total) {
+        int n = ctx -> queue -> pop(items, BATCH_SIZE);
+        for (int i = 0; i < n; i++) {
+            sum += items[i] -> value;
+        }
+        if (n > 0 && ctx -> consumed.fetch_add(n) + n >= ctx -> total) {
+            // 最后一批取完了，睡着的消费者叫起来退出
+            ctx -> queue -> wake_all(ctx -> consumers);
+        }
+    }
+    ctx -> checksum.fetch_add(sum);
+    return NULL;
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template<typename Q>
+static void run(const char* name, int producers, int consumers, long per_producer) {
+    Q queue(QUEUE_SIZE);
+    bench_ctx<Q> ctx;
+    ctx.queue = &queue;
+    ctx.per_producer = per_producer;
+    ctx.total = per_producer * producers;
+    ctx.consumers = consumers;
+    ctx.consumed.store(0);
+    ctx.checksum.store(0);
+    ctx.tasks = new task[ctx.total];
+    long expect = 0;
+    for (long i = 0; i < ctx.total; i++) {
+        ctx.tasks[i].value = (int)(i & 0xff);
+        expect += ctx.tasks[i].value;
+    }
+
+    pthread_t* threads = new pthread_t[producers + consumers];
+    producer_arg<Q>* args = new producer_arg<Q>[producers];
+    double start = now_sec();
+    for (int i = 0; i < consumers; i++) {
+        pthread_create(threads + i, NULL, consumer<Q>, &ctx);
+    }
+    for (int i = 0; i < producers; i++) {
+        args[i].ctx = &ctx;
+        args[i].index = i;
+        pthread_create(threads + consumers + i, NULL, producer<Q>, args + i);
+    }
+    for (int i = 0; i < producers + consumers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_sec() - start;
+
+    printf("%-6s %d producer(s) %d consumer(s): %8.3f s  %7.2f Mtasks/s%s\n",
+           name, producers, consumers, elapsed, ctx.total / elapsed / 1e6,
+           ctx.checksum.load() == expect ? "" : "  CHECKSUM MISMATCH");
+
+    delete [] args;
+    delete [] threads;
+    delete [] ctx.tasks;
+}
+
+int main(int argc, char* argv[]) {
+    long per_producer = argc > 1 ? atol(argv[1]) : 1000000;
+    int consumers = argc > 2 ? atoi(argv[2]) : 8;
+    if (per_producer <= 0 || consumers <= 0) {
+        printf("usage: %s [tasks_per_producer] [consumers]\n", argv[0]);
+        return 1;
+    }
+
+    // 1个生产者对应单reactor，多个生产者对应多reactor
+    int producer_counts[] = { 1, 2, 4 };
+    for (int p : producer_counts) {
+        run<list_queue>("list", p, consumers, per_producer);
+        run<ring_adapter>("ring", p, consumers, per_producer);
+    }
+    return 0;
+}
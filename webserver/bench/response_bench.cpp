@@ -0,0 +1,100 @@
+// 生成响应的开销：对同一个连接反复调用process_write，只算拼状态行、响应头、填iovec的时间，不发送
+// 分别看错误页面、304、没有进响应缓存的200、响应缓存命中的200这几种情况
+//
+// 编译: g++ -std=c++17 -O2 -pthread response_bench.cpp ../http_conn.cpp ../file_cache.cpp ../response_cache.cpp ../buffer_pool.cpp ../crlf_scan.cpp -o response_bench
+// 运行: ./response_bench [次数] [网站根目录] [文件的url]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+// 每次调用之前要把写缓冲区清空、把文件放回m_file，这些都是私有成员，这里直接打开
+#define private public
+#include "../http_conn.h"
+#undef private
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 把连接的发送状态恢复到处理请求之前，file和response是每次要发的缓存项，引用由外面持有
+static void reset(http_conn* conn, file_entry* file, cached_response* response) {
+    conn -> init_write();
+    conn -> m_file = file;
+    conn -> m_response = response;
+}
+
+static void run(const char* name, http_conn* conn, http_conn :: HTTP_CODE code,
+                file_entry* file, cached_response* response, long rounds) {
+    long bytes = 0;
+    double start = now_sec();
+    for (long i = 0; i < rounds; i++) {
+        reset(conn, file, response);
+        if (!conn -> process_write(code)) {
+            printf("%-24s process_write failed\n", name);
+            return;
+        }
+        bytes += conn -> bytes_to_send;
+    }
+    double elapsed = now_sec() - start;
+    printf("%-24s %7.1f ns/response  (%ld bytes to send)\n", name, elapsed / rounds * 1e9, bytes / rounds);
+}
+
+int main(int argc, char* argv[]) {
+    long rounds = argc > 1 ? atol(argv[1]) : 2000000;
+    const char* root = argc > 2 ? argv[2] : "../resources";
+    const char* url = argc > 3 ? argv[3] : "/index.html";
+    if (rounds <= 0) {
+        printf("usage: %s [rounds] [doc_root] [url]\n", argv[0]);
+        return 1;
+    }
+
+    http_conn :: init_responses();
+    if (!file_cache :: get_instance() -> init(root)) {
+        printf("file cache init failure: %s\n", root);
+        return 1;
+    }
+    int err = 0;
+    file_entry* file = file_cache :: get_instance() -> acquire(url, err);
+    if (!file) {
+        printf("can not load %s%s: %s\n", root, url, strerror(err));
+        return 1;
+    }
+
+    http_conn* conn = new http_conn;
+    conn -> init_request();
+    conn -> m_linger = true;   // 压测时基本都是保持连接的
+    conn -> m_path = url;
+
+    run("404 error page", conn, http_conn :: NO_RESOURCE, NULL, NULL, rounds);
+    run("304 not modified", conn, http_conn :: NOT_MODIFIED, file, NULL, rounds);
+
+    // 响应缓存还没有初始化，容量是0，每次都现拼响应头
+    run("200 file headers", conn, http_conn :: FILE_REQUEST, file, NULL, rounds);
+
+    // 放进响应缓存以后，只有状态行和Date要现生成
+    response_cache* cache = response_cache :: get_instance();
+    cache -> init(16 * 1024 * 1024);
+    reset(conn, file, NULL);
+    conn -> process_write(http_conn :: FILE_REQUEST);
+    cached_response* response = cache -> acquire(url, true);
+    if (response) {
+        run("200 response cache hit", conn, http_conn :: FILE_REQUEST, NULL, response, rounds);
+        cache -> release(response);
+    }
+    else {
+        printf("%-24s %s is not cacheable\n", "200 response cache hit", url);
+    }
+
+    file_cache :: get_instance() -> release(file);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+
+buffer_pool :: ~buffer_pool() {
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        for (size_t j = 0; j < m_free[i].size(); j++) {
+            free(m_free[i][j]);
+        }
+    }
+}
+
+// 4KB、16KB、64KB，每种是前一种的4倍
+int buffer_pool :: class_size(int index) {
+    return MIN_SIZE << (2 * index);
+}
+
+int buffer_pool :: class_of(int size) {
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        if (size <= class_size(i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+char* buffer_pool :: acquire(int& size) {
+    int index = class_of(size);
+    if (index < 0) {
+        return NULL;
+    }
+    size = class_size(index);
+
+    char* buf = NULL;
+    m_lock[index].lock();
+    if (!m_free[index].empty()) {
+        buf = m_free[index].back();
+        m_free[index].pop_back();
+    }
+    m_lock[index].unlock();
+
+    if (!buf) {
+        buf = (char*)malloc(size);
+    }
+    return buf;
+}
+
+void buffer_pool :: release(char* buf, int size) {
+    int index = class_of(size);
+    m_lock[index].lock();
+    if ((int)m_free[index].size() < MAX_FREE) {
+        m_free[index].push_back(buf);
+        buf = NULL;
+    }
+    m_lock[index].unlock();
+
+    if (buf) {
+        free(buf);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <vector>
+#include "locker.h"
+
+// 连接读缓冲区的内存池
+// 缓冲区分4KB、16KB、64KB三种大小，连接刚开始只拿一块4KB的，请求比较大放不下时再换成大一号的，
+// 请求处理完就还回来，空闲的连接不占缓冲区。还回来的块留在池子里给别的连接用，不还给系统
+class buffer_pool {
+public:
+    static const int CLASS_COUNT = 3;
+    static const int MIN_SIZE = 4 * 1024;       // 最小的一种
+    static const int MAX_SIZE = 64 * 1024;      // 最大的一种，一个请求最多这么大
+    static const int MAX_FREE = 4096;           // 每种大小在池子里最多留着的空闲块数，再多就直接释放
+
+    static buffer_pool* get_instance() {
+        static buffer_pool instance;
+        return &instance;
+    }
+
+    // 取一块至少size字节的缓冲区，size改成实际的大小；size超过MAX_SIZE时返回NULL
+    char* acquire(int& size);
+
+    // 还回一块缓冲区，size是acquire时得到的大小
+    void release(char* buf, int size);
+
+private:
+    buffer_pool() {}
+    ~buffer_pool();
+
+    static int class_of(int size);          // size对应第几种，超过最大的返回-1
+    static int class_size(int index);
+
+private:
+    std :: vector<char*> m_free[CLASS_COUNT];   // 每种大小的空闲块
+    locker m_lock[CLASS_COUNT];
+};
+
+#endif
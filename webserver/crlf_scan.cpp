@@ -0,0 +1,96 @@
+#include "crlf_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRLF_SCAN_X86
+#endif
+
+// 逐字节找，不支持SIMD的CPU用它，SIMD实现也用它处理末尾不够一个向量的部分
+static int scan_crlf_scalar(const char* buf, int begin, int end, int* out, int max) {
+    int n = 0;
+    for (int i = begin; i < end && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            out[n++] = i;
+        }
+    }
+    return n;
+}
+
+#ifdef CRLF_SCAN_X86
+
+// 一次比较16个字节，mask的每一位对应一个字节是不是'\r'或'\n'，再按位取出位置
+__attribute__((target("sse2")))
+static int scan_crlf_sse2(const char* buf, int begin, int end, int* out, int max) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    int n = 0;
+    int i = begin;
+    for (; i + 16 <= end; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(buf + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+        while (mask) {
+            if (n == max) {
+                return n;
+            }
+            out[n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;   // 去掉最低位的1
+        }
+    }
+    return n + scan_crlf_scalar(buf, i, end, out + n, max - n);
+}
+
+// 和SSE2的一样，一次32个字节
+__attribute__((target("avx2")))
+static int scan_crlf_avx2(const char* buf, int begin, int end, int* out, int max) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    int n = 0;
+    int i = begin;
+    for (; i + 32 <= end; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(buf + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, cr), _mm256_cmpeq_epi8(chunk, lf)));
+        while (mask) {
+            if (n == max) {
+                return n;
+            }
+            out[n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    // 末尾交给SSE2的实现，编译器不会在这次调用前自动清掉ymm寄存器的高128位，
+    // 不清的话SSE指令在有的CPU上要付状态切换的代价，请求头扫完的时间会慢好几倍
+    _mm256_zeroupper();
+    return n + scan_crlf_sse2(buf, i, end, out + n, max - n);
+}
+
+#endif
+
+typedef int (*scan_func)(const char*, int, int, int*, int);
+
+// 用CPUID看CPU支持哪些指令集，选最快的实现
+static scan_func choose_scan(const char** name) {
+#ifdef CRLF_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return scan_crlf_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "sse2";
+        return scan_crlf_sse2;
+    }
+#endif
+    *name = "scalar";
+    return scan_crlf_scalar;
+}
+
+static const char* scan_name;
+static scan_func scan = choose_scan(&scan_name);
+
+int scan_crlf(const char* buf, int begin, int end, int* out, int max) {
+    return scan(buf, begin, end, out, max);
+}
+
+const char* scan_crlf_impl() {
+    return scan_name;
+}
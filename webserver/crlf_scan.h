@@ -0,0 +1,12 @@
+#ifndef CRLF_SCAN_H
+#define CRLF_SCAN_H
+
+// 在buf[begin, end)里找出所有'\r'和'\n'的位置，按顺序写进out，最多写max个，返回找到的个数
+// 一次扫描就把已经读进来的这一段数据里所有的行边界都找出来，解析时按顺序取，不用再一个字节一个字节地找
+// 根据CPU支持的指令集，启动时选用AVX2(一次32字节)、SSE2(一次16字节)或者逐字节的实现
+int scan_crlf(const char* buf, int begin, int end, int* out, int max);
+
+// 当前用的是哪种实现，"avx2"、"sse2"或者"scalar"
+const char* scan_crlf_impl();
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "locker.h"
+#include "mime_types.h"
+
+// 缓存中的一个文件
+// 同一个文件被很多连接同时请求时，大家共用这一份打开的fd、stat和mmap出来的内存，
+// 用引用计数管理它的生命周期：缓存自己持有一个引用，每个正在发送它的连接也各持有一个，
+// 文件被修改后缓存把它踢掉，但正在发送的连接还拿着引用，所以不会发到一半被munmap/close
+struct file_entry {
+    int fd;                   // 一直打开着的文件描述符，sendfile从这里读
+    struct stat st;           // 文件的状态
+    char* address;            // 文件被mmap到内存中的起始位置，文件太大或者为空时为NULL
+    const mime_type* mime;    // 按扩展名查到的MIME类型，加载时查一次
+    char etag[64];            // 强ETag，带引号，由inode、修改时间和大小生成
+    std :: string validators; // ETag、Last-Modified和Cache-Control这几行响应头，200和304都带，加载时生成一次
+    std :: atomic<int> ref;   // 引用计数，减到0时才真正munmap和close
+    std :: atomic<bool> stale;   // 文件被修改后从缓存中踢掉时置为true，别人手里拿着的这一份就过时了
+};
+
+// 文件缓存，URL路径 -> file_entry
+// 命中时只需要加一个读锁查一下哈希表，不需要stat、open、mmap这些系统调用
+// 用inotify监听网站根目录，文件被修改、删除、移动时把对应的缓存项踢掉
+class file_cache {
+public:
+    static const int MMAP_MAX_SIZE = 4 * 1024 * 1024;   // 不超过这个大小的文件才会被mmap进内存
+
+    // 单例
+    static file_cache* get_instance() {
+        static file_cache instance;
+        return &instance;
+    }
+
+    static const int CACHE_CONTROL_MAX = 128;   // Cache-Control值的最大长度
+
+    // 设置网站根目录，启动inotify监听线程
+    bool init(const char* doc_root);
+
+    // url以prefix开头的文件，响应带上Cache-Control: value，有多个前缀匹配时用最长的那个
+    // 要在init之前调用，value太长时返回false
+    bool add_cache_control(const char* prefix, const char* value);
+
+    // 把url规范化：合并连续的'/'，去掉"."，有".."时返回false
+    // 同一个文件只有一种写法，缓存项和监听的目录都按规范化后的路径存，也不会访问到网站根目录外面
+    static bool canonical_url(const char* url, std :: string& out);
+
+    // 拿到url对应文件的缓存项，引用计数加一，用完后要调用release
+    // 失败时返回NULL，err为 ENOENT(文件不存在)、EACCES(没有读权限或者路径里有"..")、EISDIR(是目录)
+    file_entry* acquire(const char* url, int& err);
+
+    // 和上面一样，但key已经是canonical_url规范化过的路径，不再规范化一遍，命中时不拼字符串
+    file_entry* acquire(const std :: string& key, int& err);
+
+    // 引用计数减一，减到0时释放文件
+    void release(file_entry* entry);
+
+private:
+    file_cache();
+    ~file_cache();
+
+    file_entry* load(const char* url, int& err);     // 缓存未命中时，打开文件
+    void watch_dir(const char* url);                 // 监听url所在的目录
+    void invalidate(const std :: string& url);       // 文件变了，把它从缓存中踢掉
+    void invalidate_all();
+    void make_validators(const char* url, file_entry* entry);   // 生成ETag和验证用的响应头
+
+    static void* inotify_thread(void* arg);
+    void run();
+
+private:
+    std :: string m_doc_root;                                  // 网站根目录
+    std :: unordered_map<std :: string, file_entry*> m_files;  // 规范化的url -> 缓存项
+    std :: unordered_map<int, std :: string> m_dirs;           // inotify的watch描述符 -> 目录规范化的url
+    std :: vector<std :: pair<std :: string, std :: string> > m_cache_control;   // url前缀 -> Cache-Control的值，启动后只读
+    rwlocker m_lock;                                           // 保护上面两个表，读多写少
+    int m_inotifyfd;
+    std :: atomic<unsigned> m_generation;   // 每次踢掉缓存项都加一，用来发现加载文件期间文件被改了
+};
+
+#endif
@@ -1,19 +1,131 @@
 #include "http_conn.h"
 
-int http_conn :: m_epollfd = -1;
-int http_conn :: m_user_count = 0;
+std :: atomic<int> http_conn :: m_user_count(0);
+int http_conn :: m_max_header_size = 8192;
+int http_conn :: m_idle_timeout = 15;
+int http_conn :: m_max_requests = 1000;
 
 
 // 定义HTTP响应的一些状态信息
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_413_form = "The request body is larger than the server is willing to process.\n";
+const char* error_431_form = "The request line and headers are larger than the server is willing to process.\n";
+
+// 响应中固定不变的部分都预先生成好，生成响应时只用memcpy拼起来，不再每个头部都vsnprintf一次
+
+// 状态行在编译期就拼好了
+struct status_line {
+    int status;
+    const char* text;
+    int len;
+};
+#define STATUS_LINE(status, title) { status, "HTTP/1.1 " #status " " title "\r\n", sizeof("HTTP/1.1 " #status " " title "\r\n") - 1 }
+static const status_line status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(413, "Payload Too Large"),
+    STATUS_LINE(431, "Request Header Fields Too Large"),
+    STATUS_LINE(500, "Internal Error"),
+};
+#undef STATUS_LINE
+
+// 错误响应在状态行和Date之后的部分(响应头和页面内容)，启动时按保不保持连接各生成一份
+struct error_page {
+    error_page(int s, const char* f) : status(s), form(f) {}
+
+    int status;
+    const char* form;
+    std :: string tail[2];    // [0]不保持连接，[1]保持连接
+};
+static error_page error_pages[] = {
+    { 400, error_400_form },
+    { 403, error_403_form },
+    { 404, error_404_form },
+    { 413, error_413_form },
+    { 431, error_431_form },
+    { 500, error_500_form },
+};
+
+static const char error_content_type[] = "Content-Type: text/html\r\n";   // 错误页面的类型，文件的类型在file_entry里
+static const char close_header[] = "Connection: close\r\n";
+static std :: string keep_alive_header;    // 空闲超时是启动参数，启动时生成
+
+// 两位数字一组的查表，整数转字符串时一次写两位
+struct digit_pairs {
+    char d[200];
+    constexpr digit_pairs() : d() {
+        for (int i = 0; i < 100; i++) {
+            d[2 * i] = '0' + i / 10;
+            d[2 * i + 1] = '0' + i % 10;
+        }
+    }
+};
+static constexpr digit_pairs digits;
+
+// 非负整数转成十进制写进buf，返回长度，buf至少要20个字节
+// 从低位往高位每次写两位，循环次数只有位数的一半，也不用vsnprintf去解析格式串
+static int format_uint(char* buf, unsigned long long value) {
+    char tmp[20];
+    char* p = tmp + sizeof(tmp);
+    while (value >= 100) {
+        int i = (int)(value % 100) * 2;
+        value /= 100;
+        p -= 2;
+        memcpy(p, digits.d + i, 2);
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, digits.d + value * 2, 2);
+    }
+    else {
+        *--p = '0' + (char)value;
+    }
+    int len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+// Date头部每个线程缓存一份，秒数变了才重新格式化，同一秒内的响应直接拷贝
+struct date_cache {
+    time_t sec;
+    char line[64];
+    int len;
+};
+static thread_local date_cache t_date = { -1, {0}, 0 };
+
+static const date_cache& current_date() {
+    time_t now = time(NULL);
+    if (now != t_date.sec) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        t_date.len = strftime(t_date.line, sizeof(t_date.line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        t_date.sec = now;
+    }
+    return t_date;
+}
+
+void http_conn :: init_responses() {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "Connection: keep-alive\r\nKeep-Alive: timeout=%d\r\n", m_idle_timeout);
+    keep_alive_header = buf;
+
+    for (size_t i = 0; i < sizeof(error_pages) / sizeof(error_pages[0]); i++) {
+        for (int linger = 0; linger < 2; linger++) {
+            std :: string& tail = error_pages[i].tail[linger];
+            tail = "Content-Length: " + std :: to_string(strlen(error_pages[i].form)) + "\r\n";
+            tail += error_content_type;
+            tail += linger ? keep_alive_header : close_header;
+            tail += "\r\n";
+            tail += error_pages[i].form;
+        }
+    }
+}
 
 // 网站的根目录
 const char* doc_root = "/home/wensong/webserver/resources";
@@ -37,7 +149,7 @@ void addfd(int epollfd, int fd, bool one_shot){
                                                                                             // 客户端是否关闭连接
     event.events = EPOLLIN | EPOLLET | EPOLLRDHUP; // 边缘触发  // 注意，千万不要把listenfd设置成边缘触发，会报错
     if (one_shot) {
-        event.events | EPOLLONESHOT;
+        event.events |= EPOLLONESHOT;  // 之前写成了 event.events | EPOLLONESHOT，没有生效，多个reactor和工作线程同时处理一个socket就乱了
     }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event); // 将需要监听的文件描述符fd放到监听对象中epollfd(即交给epollfd去监听fd)
 
@@ -60,9 +172,15 @@ void modfd(int epollfd, int fd, int ev) {
 }
 
 // 初始化新接受的客户端的连接
-void http_conn :: init(int sockfd, const sockaddr_in& addr){
+void http_conn :: init(int sockfd, const sockaddr_in& addr, int epollfd, time_wheel* timers){
     m_sockfd = sockfd;
     m_address = addr;
+    m_epollfd = epollfd;
+    m_timers = timers;
+    m_request_count = 0;
+    // 上一个连接关闭时已经把读缓冲区还回去了；构造函数里不初始化，这样没用过的连接槽不占物理内存
+    m_read_buf = NULL;
+    m_read_size = 0;
 
     // 设置端口复用
     // 1.防止服务器重启时之前绑定的端口还没释放 2.程序突然退出而系统没有释放端口
@@ -74,56 +192,127 @@ void http_conn :: init(int sockfd, const sockaddr_in& addr){
     addfd(m_epollfd, m_sockfd, true);
     m_user_count++;   // 客户端的连接数加一
 
+    // 连上来一直不发请求的连接也要按空闲超时关掉
+    m_timer.user_data = this;
+    m_timer.cb_func = idle_timeout;
+    refresh_timer();
+
     init();
 
 }
 
 
 void http_conn:: init() {
+    m_read_idx = 0;
+    init_request();
+    init_write();
+
+    release_read_buf();   // 下一个请求来了再取，空闲的连接不占读缓冲区
+    bzero(m_write_buf, WRITE_BUFFER_SIZE);
+
+}
+
+void http_conn :: init_request() {
     m_check_state = CHECK_STATE_REQUESTLINE;    // 初始化状态为解析请求首行
     m_checked_index = 0;    
     m_start_line = 0;
-    m_read_idx = 0;
+    m_crlf_count = 0;
+    m_crlf_next = 0;
+    m_scanned_idx = 0;
+    m_request_end = -1;
 
     m_method = GET;         // 默认请求方式为GET
     m_url = 0;
     m_version = 0;
     m_linger = false;       // 默认不保持链接  Connection : keep-alive保持连接
 
-    m_write_idx = 0;
-    m_host = 0;
     m_content_length = 0;
+    m_header_count = 0;
+    memset(m_known_headers, -1, sizeof(m_known_headers));
+}
 
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+void http_conn :: init_write() {
+    m_write_idx = 0;
+    m_file = NULL;
+    m_response = NULL;
+    m_held_count = 0;
+    m_write_linger = false;
+    m_file_fd = -1;
+    m_file_offset = 0;
+    m_readahead = 0;
+    m_iv_count = 0;
+    m_iv_next = 0;
+    bytes_to_send = 0;
+    bytes_have_send = 0;
+}
 
-    memset((void*)&m_file_stat, 0x00, sizeof(m_file_stat));   // 将这个状态也清空一下，我靠你文件名都清空了，stat坑定也要清空吧
+// 客户端可以不等响应就连着发好几个请求(HTTP/1.1流水线)，一次read()可能读进来不止一个请求
+// 当前请求处理完了，后面剩下的字节就是下一个请求的开头，挪到缓冲区的开头，从头开始解析
+void http_conn :: next_request() {
+    int left = m_read_idx - m_request_end;
+    if (left > 0) {
+        memmove(m_read_buf, m_read_buf + m_request_end, left + 1);   // 连同末尾的'\0'一起挪
+    }
+    m_read_idx = left;
+    init_request();
+    if (left == 0) {
+        release_read_buf();   // 没有剩下的请求了，空闲的连接不占读缓冲区
+    }
+}
 
+// 前面的响应保持连接、读缓冲区里还有数据、而且还放得下下一个响应时，接着处理下一个请求
+// sendfile发送的大文件只能排在最后
+bool http_conn :: can_pipeline() const {
+    return m_linger && m_request_end < m_read_idx
+        && m_held_count < MAX_PIPELINE && m_file_fd == -1
+        && WRITE_BUFFER_SIZE - m_write_idx >= PIPELINE_WRITE_RESERVE;
 }
 
 // 关闭连接
 void http_conn:: close_conn(){
 
     if (m_sockfd != -1) {
+        m_timers -> del_timer(&m_timer);
+        close_file();   // 文件可能还没发完连接就断了
+        release_read_buf();
         removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;  // 文件描述符都为-1了，那这个文件描述符也就没用了，为啥，因为文件描述符是从0增大
         m_user_count--;  // 总的客户端的连接数减一
     }
 }
 
+// 空闲超时从现在开始重新计时
+void http_conn :: refresh_timer() {
+    m_timer.expire = time(NULL) + m_idle_timeout;
+    m_timers -> adjust_timer(&m_timer);
+}
+
+// 工作线程不能直接关闭连接：定时器挂在reactor的时间轮上，只有reactor线程能碰；fd关了还可能马上被别的连接复用
+// 所以只关掉socket的读写，再注册一下事件，reactor会收到EPOLLHUP，在那里关闭连接
+void http_conn :: shutdown_conn() {
+    shutdown(m_sockfd, SHUT_RDWR);
+    modfd(m_epollfd, m_sockfd, EPOLLIN);
+}
+
+// 保持的连接空闲太久了，在reactor线程里调用
+// 这时连接可能正在工作线程里处理，不能直接关闭，和shutdown_conn一样交给EPOLLHUP去关
+// 一次tick可能关掉成千上万个空闲连接，这里不打印，免得在事件循环里一个一个地写stdout
+void http_conn :: idle_timeout(http_conn* conn) {
+    shutdown(conn -> m_sockfd, SHUT_RDWR);
+}
 
 // 循环读取客户数据，直到无数据刻度或者对方关闭连接
+// 读缓冲区满了就换大一号的；已经不能再大了(头部超过了限制，或者到了最大的64KB)就先不读了，
+// 由process_read判断是回复431/413，还是已经收到了完整的请求
 bool http_conn :: read() {
 
-    if (m_read_idx >= READ_BUFFER_SIZE) {
-        return false;
-    }
-    
     // 已经读取到的字节
     int bytes_read = 0;
     while(true) {
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        if (m_read_idx + 1 >= m_read_size && !grow_read_buf()) {
+            break;
+        }
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, m_read_size - 1 - m_read_idx, 0);
         if (bytes_read == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // 没有数据了,因为我们是非阻塞的读（因为前面，这个套接字已经被设为非阻塞模式了），当输入缓冲区没有数据时，会报错errno = EAGAIN或者EWOULDBLOCK这两个等价
@@ -136,11 +325,49 @@ bool http_conn :: read() {
             return false;
         }
         m_read_idx += bytes_read;
+        m_read_buf[m_read_idx] = '\0';   // 缓冲区不再清零，读进来的数据后面补一个'\0'
     }
     printf("读取到了数据 : %s\n", m_read_buf);
     return true;
 }
 
+// 第一次读的时候取一块最小的，满了以后换成大一号的，把已经读到的数据拷过去
+bool http_conn :: grow_read_buf() {
+    if (m_read_buf && m_check_state != CHECK_STATE_CONTENT && m_read_idx >= m_max_header_size) {
+        return false;   // 头部还没收完就已经超过限制了，不用再读了
+    }
+    int size = m_read_buf ? m_read_size + 1 : buffer_pool :: MIN_SIZE;
+    char* buf = buffer_pool :: get_instance() -> acquire(size);
+    if (!buf) {
+        return false;   // 已经是最大的了
+    }
+    if (m_read_buf) {
+        memcpy(buf, m_read_buf, m_read_idx + 1);
+        // 请求行解析出来的指针指向旧的缓冲区，要挪到新的缓冲区里，头部记的是偏移，不用管
+        if (m_url) {
+            m_url = buf + (m_url - m_read_buf);
+        }
+        if (m_version) {
+            m_version = buf + (m_version - m_read_buf);
+        }
+        buffer_pool :: get_instance() -> release(m_read_buf, m_read_size);
+    }
+    else {
+        buf[0] = '\0';
+    }
+    m_read_buf = buf;
+    m_read_size = size;
+    return true;
+}
+
+void http_conn :: release_read_buf() {
+    if (m_read_buf) {
+        buffer_pool :: get_instance() -> release(m_read_buf, m_read_size);
+        m_read_buf = NULL;
+        m_read_size = 0;
+    }
+}
+
 // 主状态机，解析请求
 http_conn::HTTP_CODE http_conn:: process_read() {
 
@@ -149,8 +376,9 @@ http_conn::HTTP_CODE http_conn:: process_read() {
 
     char* text = 0;
 
+    // 请求体不按行解析，收不全时不能再去parse_line，否则m_checked_index会被推到已读数据的末尾，请求体的起始位置就丢了
     while(((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK))
-       || ((line_status = parse_line()) == LINE_OK)) {
+       || ((m_check_state != CHECK_STATE_CONTENT) && ((line_status = parse_line()) == LINE_OK))) {
             // 解析到了一行完整的数据，或者解析到了请求体，也是一块完整的数据
 
             // 获取一行数据
@@ -173,10 +401,11 @@ http_conn::HTTP_CODE http_conn:: process_read() {
                 case CHECK_STATE_HEADER: {
                     printf("got head http line : %s\n", text);
                     ret = parse_headers(text);
-                    if (ret == BAD_REQUEST) {
-                        return BAD_REQUEST;
+                    if (ret == BAD_REQUEST || ret == HEADERS_TOO_LARGE || ret == ENTITY_TOO_LARGE) {
+                        return ret;
                     }
                     else if (ret ==  GET_REQUEST) {
+                        m_request_end = m_checked_index;   // 没有请求体，请求到空行就结束了
                         return do_request();
                     }
                     break;
@@ -187,6 +416,7 @@ http_conn::HTTP_CODE http_conn:: process_read() {
                     printf("got content http line : %s\n", text);
                     ret = parse_content(text);
                     if (ret == GET_REQUEST) {
+                        m_request_end = m_checked_index + m_content_length;
                         return do_request();
                     }
                     line_status = LINE_OPEN; // 表示数据不完成
@@ -202,6 +432,11 @@ http_conn::HTTP_CODE http_conn:: process_read() {
             }
     }
 
+    // 请求行和头部还没收完，就已经超过限制了，读缓冲区也不会再变大了
+    if (m_check_state != CHECK_STATE_CONTENT && m_read_idx >= m_max_header_size) {
+        return HEADERS_TOO_LARGE;
+    }
+
     return NO_REQUEST;
 }                
 
@@ -209,6 +444,9 @@ http_conn::HTTP_CODE http_conn:: process_read() {
 http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     //  GET /index.html HTTP/1.1
     m_url = strpbrk(text, " \t");  // 检测text中，' ' 和 '\t'哪个先出现，并将位置返回
+    if (!m_url) {
+        return BAD_REQUEST;
+    }
 
     //   GET\0/index.html HTTP/1.1
     *m_url++ = '\0';
@@ -229,7 +467,14 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
 
     //   /index.html\0HTTP/1.1
     *m_version++ = '\0';
-    if (strcasecmp(m_version, "HTTP/1.1") != 0){
+    // HTTP/1.1默认保持连接，除非请求带Connection: close；HTTP/1.0默认不保持，除非带Connection: keep-alive
+    if (strcasecmp(m_version, "HTTP/1.1") == 0) {
+        m_linger = true;
+    }
+    else if (strcasecmp(m_version, "HTTP/1.0") == 0) {
+        m_linger = false;
+    }
+    else {
         return BAD_REQUEST;
     }
 
@@ -253,6 +498,16 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
 
     // 遇到空行，表示头部字段解析完毕
     if (text[0] == '\0') {
+        if (m_checked_index > m_max_header_size) {
+            return HEADERS_TOO_LARGE;
+        }
+        if (m_content_length < 0) {
+            return BAD_REQUEST;
+        }
+        // 整个请求要能放进最大的读缓冲区，还要留一个字节给'\0'
+        if (m_content_length > buffer_pool :: MAX_SIZE - 1 - m_checked_index) {
+            return ENTITY_TOO_LARGE;
+        }
         // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体
         // 主状态机状态要转移到CHECK_STATE_CONTENT状态
         if (m_content_length != 0) {  
@@ -263,39 +518,90 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
         // 否则说明我们已经得到了一个完整的HTTP请求
         return GET_REQUEST;     // 这个地方返回这个，表示没有请求体，请求到这就结束了
     }
-    else if ( strncasecmp(text, "Connection:", 11) == 0) {
-        // 处理Connection 头部字段 Conection : keep-alive
-        text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "keep-alive") == 0) {
-            m_linger = true;  // 保持连接
-        }
+
+    // 名字和值用冒号隔开，  Name: value
+    char* colon = strchr(text, ':');
+    if (!colon || colon == text) {
+        return BAD_REQUEST;
     }
-    else if (strncasecmp(text, "Content-Length:", 15) == 0) {
-        // 处理Content-Length头部字段
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atol(text);
+    if (m_header_count >= MAX_HEADERS) {
+        return HEADERS_TOO_LARGE;   // 头部太多了，请求本身没错，和头部太长一样回复431
     }
-    else if (strncasecmp(text, "Host:", 5) == 0) {
-        // 处理Host头部字段
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
+
+    // 值去掉前后的空白
+    char* value = colon + 1;
+    value += strspn(value, " \t");
+    int value_len = strlen(value);
+    while (value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+        value_len--;
     }
-    else {
-        printf("oop! unknow header %s\n", text);
+
+    // 只记下名字和值在读缓冲区里的位置，不拷贝
+    http_header* header = &m_headers[m_header_count];
+    header -> name = text - m_read_buf;
+    header -> name_len = colon - text;
+    header -> value = value - m_read_buf;
+    header -> value_len = value_len;
+    header -> id = lookup_header(text, header -> name_len);   // 完美哈希，算一次哈希比较一次就知道是不是认识的头部
+    if (header -> id != HEADER_UNKNOWN) {
+        m_known_headers[header -> id] = m_header_count;   // 同一个头部出现多次时以最后一个为准
+    }
+    m_header_count++;
+
+    switch (header -> id) {
+        case HEADER_CONNECTION: {
+            // 处理Connection 头部字段 Conection : keep-alive，值是逗号隔开的一串选项，比如 keep-alive, Upgrade
+            const char* end = value + value_len;
+            const char* token = value;
+            while (token < end) {
+                const char* comma = (const char*)memchr(token, ',', end - token);
+                const char* token_end = comma ? comma : end;
+                while (token < token_end && (*token == ' ' || *token == '\t')) {
+                    token++;
+                }
+                int len = token_end - token;
+                while (len > 0 && (token[len - 1] == ' ' || token[len - 1] == '\t')) {
+                    len--;
+                }
+                if (len == 5 && strncasecmp(token, "close", 5) == 0) {
+                    m_linger = false;   // 有close时以close为准
+                    break;
+                }
+                if (len == 10 && strncasecmp(token, "keep-alive", 10) == 0) {
+                    m_linger = true;  // 保持连接
+                }
+                token = token_end + 1;
+            }
+            break;
+        }
+        case HEADER_CONTENT_LENGTH: {
+            // 处理Content-Length头部字段，太大的先截到最大缓冲区的大小，空行时会回复413
+            long content_length = atol(value);
+            m_content_length = content_length > buffer_pool :: MAX_SIZE ? buffer_pool :: MAX_SIZE : content_length;
+            break;
+        }
+        default:
+            break;
     }
 
     return NO_REQUEST;
 
 }
 
+const char* http_conn::get_header(HEADER_ID id, int* len) const {
+    int i = m_known_headers[id];
+    if (i < 0) {
+        return NULL;
+    }
+    *len = m_headers[i].value_len;
+    return m_read_buf + m_headers[i].value;
+}
+
 // 我们没有真正解析HTTP请求的消息体，只是判断它是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content(char* text){
+http_conn::HTTP_CODE http_conn::parse_content(char*){
     
     if (m_read_idx >= ( m_content_length + m_checked_index)) {
-        text[m_content_length] = '\0';  // 在这里截断，会影响到下一个请求吗，会把下一个请求的第一个字符改了吗
+        // 请求体后面紧跟着的可能就是流水线上的下一个请求，不能在这里写'\0'截断
         return GET_REQUEST;
     }
 
@@ -303,242 +609,453 @@ http_conn::HTTP_CODE http_conn::parse_content(char* text){
 }  
 
 // 解析一行，判断依据\r\n
+// 行边界不再一个字节一个字节地找：m_crlf里是用SIMD一次扫描出来的所有'\r'和'\n'的位置，这里按顺序取下一个，
+// 用完了再扫描新读进来的数据
 http_conn::LINE_STATUS http_conn::parse_line(){
-    char temp;
+    while (true) {
+        if (m_crlf_next == m_crlf_count) {
+            if (m_scanned_idx >= m_read_idx) {
+                // 已经读进来的数据里没有行结束符了，这一行还没收完，等更多的数据
+                m_checked_index = m_read_idx;
+                return LINE_OPEN;
+            }
+            m_crlf_count = scan_crlf(m_read_buf, m_scanned_idx, m_read_idx, m_crlf, CRLF_BATCH);
+            m_crlf_next = 0;
+            // m_crlf装满了的话，最后一个边界之后的数据下次再扫描
+            m_scanned_idx = (m_crlf_count == CRLF_BATCH) ? m_crlf[CRLF_BATCH - 1] + 1 : m_read_idx;
+            continue;
+        }
 
-    for ( ; m_checked_index < m_read_idx; ++m_checked_index){
-        temp = m_read_buf[m_checked_index];
+        int pos = m_crlf[m_crlf_next];
+        if (pos < m_checked_index) {
+            // 作为上一行结尾的\r\n已经用过了
+            m_crlf_next++;
+            continue;
+        }
+        m_checked_index = pos;
 
-        if (temp == '\r') {
-            if ((m_checked_index + 1) == m_read_idx) {     // 如果当前字符是\r，但是缓冲中，已经没有数据了，这是最后一个数据，所以表示数据不完整
-                return LINE_OPEN;                          // 数据没请求完
+        if (m_read_buf[pos] == '\r') {
+            if ((pos + 1) == m_read_idx) {     // 如果当前字符是\r，但是缓冲中，已经没有数据了，这是最后一个数据，所以表示数据不完整
+                return LINE_OPEN;              // 数据没请求完，这个边界留着，数据来了从这里接着判断
             }
-            else if (m_read_buf[m_checked_index + 1] == '\n') {       // 当前字符是\r,如果下一个字符是\n，说明读取到了一行，然后将\r\n都变成\0,
-                m_read_buf[m_checked_index++] = '\0';                 // 相当于从缓冲中，截出这一行
-                m_read_buf[m_checked_index++] = '\0';
+            else if (m_read_buf[pos + 1] == '\n') {       // 当前字符是\r,如果下一个字符是\n，说明读取到了一行，然后将\r\n都变成\0,
+                m_read_buf[pos] = '\0';                   // 相当于从缓冲中，截出这一行
+                m_read_buf[pos + 1] = '\0';
+                m_checked_index = pos + 2;
+                m_crlf_next++;
                 return LINE_OK;
             }
 
             return LINE_BAD;
         }
-        else if (temp == '\n') {
 
-            if ((m_checked_index > 1) && (m_read_buf[m_checked_index -1] == '\r')) {  // 针对上面的第一种情况，读到\r,但是缓冲区没数据了
-                m_read_buf[m_checked_index-1] = '\0';                                 // 然后来了，数据，一检测，第一个字符是\n,前面一个字符又是\r,
-                m_read_buf[m_checked_index++] = '\0';                                 // 说明这是一行
-                return LINE_OK;                                                   
-            }                                                                         
-            return LINE_BAD;
+        // 当前字符是\n，前面一个字符是\r，说明这是一行
+        if ((pos > 1) && (m_read_buf[pos - 1] == '\r')) {
+            m_read_buf[pos - 1] = '\0';
+            m_read_buf[pos] = '\0';
+            m_checked_index = pos + 1;
+            m_crlf_next++;
+            return LINE_OK;
         }
-        // return LINE_OPEN;   警钟长鸣，我靠
+        return LINE_BAD;
     }
-
-
-
-
-    return LINE_OK;
 }
 
 // 当得到一个完成、正确的HTTP请求时，我们就分析目标文件的属性
-// 如果目标文件存在，对所有用户可读，且不是目录，则使用mmap将其
-// 映射到内存地址m_file_address处，并告诉调用者获取文件成功
+// 如果目标文件存在，对所有用户可读，且不是目录，就从文件缓存中拿到它打开的fd和mmap的地址
+// 缓存命中时不需要拼路径，也没有stat、open、mmap这些系统调用
 http_conn:: HTTP_CODE http_conn :: do_request(){
 
-    //  "/home/wensong/webserver/resources"
-    strcpy(m_real_file, doc_root);
-    int len = strlen(doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len -1);   // 服务器的项目根目录 + 请求文件的目录， 合体
-    // 获取m_real_file文件的相关的状态信息，-1 失败， 0 成功
-    if (stat(m_real_file, &m_file_stat) < 0) {
-        return NO_RESOURCE;
+    // 一个连接上处理的请求数到了上限，这个响应带上Connection: close，发完就关闭连接
+    // 要在查响应缓存之前决定，缓存里的响应是按是否保持连接分开存的
+    m_request_count++;
+    if (m_max_requests > 0 && m_request_count >= m_max_requests) {
+        m_linger = false;
     }
-    
-    // 判断访问权限
-    if (!(m_file_stat.st_mode &S_IROTH)) {
+
+    // "/a//b"、"/a/./b"都是"/a/b"，按一种写法查缓存；有".."的不让访问
+    if (!file_cache :: canonical_url(m_url, m_path)) {
         return FORBIDDEN_REQUEST;
     }
 
-    // 判断是否是目录
-    if (S_ISDIR(m_file_stat.st_mode)) {
-        return BAD_REQUEST;
+    // 小文件先查响应缓存，命中的话响应行、响应头都不用再生成了
+    m_response = response_cache :: get_instance() -> acquire(m_path.c_str(), m_linger);
+    if (m_response) {
+        return not_modified(m_response -> file) ? NOT_MODIFIED : FILE_REQUEST;
+    }
+
+    int err = 0;
+    m_file = file_cache :: get_instance() -> acquire(m_path, err);   // m_path已经规范化过了
+    if (!m_file) {
+        if (err == EACCES) {
+            return FORBIDDEN_REQUEST;   // 没有访问权限
+        }
+        else if (err == EISDIR) {
+            return BAD_REQUEST;         // 是目录
+        }
+        return NO_RESOURCE;
     }
+    return not_modified(m_file) ? NOT_MODIFIED : FILE_REQUEST;
+}
 
-    // 以只读方式打开文件
-    int fd = open( m_real_file, O_RDONLY );
-    // 创建内存映射
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
-    return FILE_REQUEST;
+// 条件请求：有If-None-Match时只看它，按弱比较(忽略W/)和文件的ETag比；没有时才看If-Modified-Since
+bool http_conn :: not_modified(const file_entry* file) const {
+    int len;
+    const char* value = get_header(HEADER_IF_NONE_MATCH, &len);
+    if (value) {
+        int etag_len = strlen(file -> etag);
+        const char* end = value + len;
+        while (value < end) {
+            // 值是逗号分隔的ETag列表
+            while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+                value++;
+            }
+            const char* tag = value;
+            while (value < end && *value != ',') {
+                value++;
+            }
+            const char* tag_end = value;
+            while (tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t')) {
+                tag_end--;
+            }
+            if (tag_end - tag == 1 && *tag == '*') {
+                return true;
+            }
+            if (tag_end - tag > 2 && strncmp(tag, "W/", 2) == 0) {
+                tag += 2;
+            }
+            if (tag_end - tag == etag_len && strncmp(tag, file -> etag, etag_len) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    value = get_header(HEADER_IF_MODIFIED_SINCE, &len);
+    if (!value || len >= 64) {
+        return false;
+    }
+    // 值不一定以'\0'结尾，拷出来再解析
+    char date[64];
+    memcpy(date, value, len);
+    date[len] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* parsed = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!parsed || *parsed != '\0') {
+        return false;   // 格式不对就当作没有这个头部
+    }
+    time_t since = timegm(&tm);
+    // 比现在还晚的时间是无效的
+    return since <= time(NULL) && file -> st.st_mtime <= since;
 }
 
 
-// 对内存映射区执行munmap操作, 即用完了，释放掉
-void http_conn::unmap() {
-    if( m_file_address )
+// 文件发送完了，把缓存项的引用还回去
+void http_conn::close_file() {
+    for( int i = 0; i < m_held_count; i++ ) {
+        if( m_held_files[ i ] ) {
+            file_cache :: get_instance() -> release( m_held_files[ i ] );
+        }
+        if( m_held_responses[ i ] ) {
+            response_cache :: get_instance() -> release( m_held_responses[ i ] );
+        }
+    }
+    m_held_count = 0;
+    // 还没排进发送队列的(生成响应时出错了)
+    if( m_file )
+    {
+        file_cache :: get_instance() -> release( m_file );
+        m_file = NULL;
+    }
+    if( m_response )
     {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
+        response_cache :: get_instance() -> release( m_response );
+        m_response = NULL;
     }
+    m_file_fd = -1;
 }
 
 
 // 写HTTP响应
-bool http_conn::write()
+// 这是一个可以断点续传的状态机：先用sendmsg发内存中的数据(响应行、响应头，小文件的话还有mmap在缓存里的文件内容)，
+// 大文件再用sendfile从文件偏移m_file_offset处发文件内容。TCP写缓冲满了(EAGAIN)时，不在这里空转等待，而是记下发送进度，重新注册EPOLLOUT后返回，
+// 等socket可写了reactor会再调用write()，从断开的地方接着发
+http_conn::WRITE_STATUS http_conn::write()
 {
-    int temp = 0;
-    int bytes_have_send = 0;    // 已经发送的字节
-    // int bytes_to_send = m_write_idx;// 将要发送的字节 （m_write_idx）写缓冲区中待发送的字节数
-    int bytes_to_send = m_write_idx + m_file_stat.st_size;// 将要发送的字节 （m_write_idx）写缓冲区中待发送的字节数
-    
+    ssize_t temp = 0;
+
     if ( bytes_to_send == 0 ) {
         // 将要发送的字节为0，这一次响应结束。
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
-        init();
-        return true;
-    }
-    /*
-    雀氏是有问题的这里，用的是分散写，两块地址，但是上面的bytes_to_send赋的值是写缓冲区中的长度，不包含响应正文的长度
-    但是下面用bytes_to_send - temp 去判断是否发送完毕，而temp是包含两块地方的长度的，所以有问题，
-    这就是为什么，我传输一张的像素大的照片会传输失败，
-    原因： 
-    1. 下面判断HTTP中响应是否发送完毕的if条件中，之前用的是bytes_to_send <= bytes_have_send,这坑定是错的，bytes_to_send一直在递减，
-    所以导致，如果两块地址的东西太大，需要传输多次，那必定是没传输完毕就终止了，现在改了成m_write_idx
-    
-    2. 改了m_write_idx，也有问题，因为m_write_idx是响应行+响应头的长度，响应正文的长度没加，现在加上
-    
-    3. 还有如果tcp缓冲区没有空间了，然后重新发送，但是有个问题，这里重新发送没有接着前面已经发送的后面发送，还是重新发，那会导致数据一直是不完整的
-    */
+        return write_done();
+    }
+
     while(1) {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        if ( m_iv_count > 0 ) {
+            // 先发内存里的数据，后面还有文件内容的话带上MSG_MORE，让内核把响应头和文件的开头拼成一个满的TCP报文再发，
+            // 效果和TCP_CORK一样，但不用多两次setsockopt
+            struct msghdr msg;
+            memset( &msg, 0, sizeof( msg ) );
+            msg.msg_iov = m_iv + m_iv_next;
+            msg.msg_iovlen = m_iv_count;
+            temp = sendmsg( m_sockfd, &msg, ( m_file_fd != -1 ) ? MSG_MORE : 0 );
+        }
+        else {
+            // 零拷贝发送文件，sendfile会把m_file_offset推进temp个字节
+            // 一次最多发一个窗口，并保证后面一个窗口已经让内核开始预读，读磁盘和发送能重叠起来
+            off_t end = m_file_offset + bytes_to_send;
+            if ( m_readahead < m_file_offset ) {
+                m_readahead = m_file_offset;
+            }
+            while ( m_readahead < m_file_offset + 2 * STREAM_WINDOW && m_readahead < end ) {
+                posix_fadvise( m_file_fd, m_readahead, STREAM_WINDOW, POSIX_FADV_WILLNEED );
+                m_readahead += STREAM_WINDOW;
+            }
+            temp = sendfile( m_sockfd, m_file_fd, &m_file_offset, bytes_to_send < STREAM_WINDOW ? bytes_to_send : STREAM_WINDOW );
+            if ( temp == 0 ) {
+                // 文件在发送过程中被截断了，已经发不出承诺的Content-Length那么多字节，只能断开
+                close_file();
+                return WRITE_CLOSE;
+            }
+        }
         if ( temp <= -1 ) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if( errno == EAGAIN ) {
-                // modfd( m_epollfd, m_sockfd, EPOLLOUT );   // 如果在这里重置EPOLLOUT事件，并且返回的话，那等缓冲区有了空间，重新执行write，导致重新从头发送数据，那么永远也发不完整
-                // return true;  // 返回true，是不关这个tcp连接，然后继续写
-                continue;      // 如果是tcp写缓冲区满了，那就循环，等到缓冲区不满了，再继续写，可是这样写了之后，大文件还是会被截断，为什么
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );   // 发送进度已经记下了，下次可写时接着发，不会从头重发
+                return WRITE_OK;                          // 不关这个tcp连接
             }
-            unmap();
-            return false;
+            close_file();
+            return WRITE_CLOSE;
         }
-        bytes_to_send -= temp;   // 这句感觉没什么用
         bytes_have_send += temp;
-        if ( m_write_idx + m_file_stat.st_size <= bytes_have_send ) {
-            // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
-            unmap();
-            if(m_linger) {    // 这里的m_linger通过下面return true还是false起作用，如果是false，外面就close(fd)了
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return true;
-            } else {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return false;
-            } 
+        bytes_to_send -= temp;
+
+        // 把m_iv推进到还没发送的位置，已经发完的内存块丢掉
+        while ( m_iv_count > 0 && temp > 0 ) {
+            if ( temp >= (ssize_t)m_iv[ m_iv_next ].iov_len ) {
+                temp -= m_iv[ m_iv_next ].iov_len;
+                m_iv_next++;
+                m_iv_count--;
+            }
+            else {
+                m_iv[ m_iv_next ].iov_base = (char*)m_iv[ m_iv_next ].iov_base + temp;
+                m_iv[ m_iv_next ].iov_len -= temp;
+                temp = 0;
+            }
+        }
+
+        if ( bytes_to_send <= 0 ) {
+            return write_done();
         }
     }
 }
 
-// 往写缓冲中写入待发送的数据
-bool http_conn::add_response( const char* format, ... ) {
-    if( m_write_idx >= WRITE_BUFFER_SIZE ) {
-        return false;
+// 这一批响应都发送成功了，根据最后一个请求的Connection字段决定是否立即关闭连接
+// 返回WRITE_CLOSE外面就close(fd)了
+http_conn::WRITE_STATUS http_conn::write_done()
+{
+    close_file();
+    if ( !m_write_linger ) {
+        return WRITE_CLOSE;
+    }
+    init_write();
+
+    if ( m_request_end < 0 ) {
+        // 流水线上后面那个请求只收到了一部分，已经解析到的状态留着，读到更多的数据后接着解析
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        return WRITE_OK;
+    }
+    next_request();
+    if ( m_read_idx > 0 ) {
+        // 读缓冲区里还有流水线上的请求(上一批放不下的)，马上交给工作线程解析，不用等下一次EPOLLIN
+        // 这里是reactor线程，解析和do_request可能要打开文件，不能在这里做，否则会卡住这个reactor上所有的连接
+        return WRITE_PROCESS;
     }
-    va_list arg_list;
-    va_start( arg_list, format );
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) ) {
+    modfd( m_epollfd, m_sockfd, EPOLLIN );
+    return WRITE_OK;
+}
+
+// 往写缓冲中写入待发送的数据
+bool http_conn::add_bytes( const char* data, int len ) {
+    if( len > WRITE_BUFFER_SIZE - 1 - m_write_idx ) {
         return false;
     }
+    memcpy( m_write_buf + m_write_idx, data, len );
     m_write_idx += len;
-    va_end( arg_list );
     return true;
 }
 
-bool http_conn::add_status_line( int status, const char* title ) {
-    return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+// 状态行后面紧跟着Date头部
+bool http_conn::add_status_line( int status ) {
+    for( size_t i = 0; i < sizeof( status_lines ) / sizeof( status_lines[ 0 ] ); i++ ) {
+        if( status_lines[ i ].status == status ) {
+            const date_cache& date = current_date();
+            return add_bytes( status_lines[ i ].text, status_lines[ i ].len ) && add_bytes( date.line, date.len );
+        }
+    }
+    return false;
 }
 
-bool http_conn::add_headers(int content_len) {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
-    return true;
+bool http_conn::add_headers(off_t content_len) {
+    return add_content_length(content_len) && add_content_type() && add_validators(m_file) && add_linger() && add_blank_line();
 }
 
-bool http_conn::add_content_length(int content_len) {
-    return add_response( "Content-Length: %d\r\n", content_len );
+bool http_conn::add_content_length(off_t content_len) {
+    char buf[48];
+    memcpy( buf, "Content-Length: ", 16 );
+    int len = 16 + format_uint( buf + 16, content_len );
+    buf[ len++ ] = '\r';
+    buf[ len++ ] = '\n';
+    return add_bytes( buf, len );
 }
 
+// 保持连接时告诉客户端空闲多久会被关掉，这个值对所有连接都一样，所以响应缓存里的响应也可以带上
 bool http_conn::add_linger()
 {
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+    if ( !m_linger ) {
+        return add_bytes( close_header, sizeof( close_header ) - 1 );
+    }
+    return add_bytes( keep_alive_header.data(), keep_alive_header.size() );
 }
 
 bool http_conn::add_blank_line()
 {
-    return add_response( "%s", "\r\n" );
+    return add_bytes( "\r\n", 2 );
 }
 
-bool http_conn::add_content( const char* content )
-{
-    return add_response( "%s", content );
+// 文件的类型在加载进文件缓存时就查好了
+bool http_conn::add_content_type() {
+    return add_bytes( m_file -> mime -> header, m_file -> mime -> header_len );
 }
 
-bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+// ETag、Last-Modified和Cache-Control在文件加载进缓存时就生成好了
+bool http_conn::add_validators( const file_entry* file ) {
+    return add_bytes( file -> validators.data(), file -> validators.size() );
+}
+
+// 错误响应：状态行和Date之后整段拷贝启动时生成好的响应头和页面
+bool http_conn::add_error( int status ) {
+    for( size_t i = 0; i < sizeof( error_pages ) / sizeof( error_pages[ 0 ] ); i++ ) {
+        if( error_pages[ i ].status == status ) {
+            const std :: string& tail = error_pages[ i ].tail[ m_linger ? 1 : 0 ];
+            return add_status_line( status ) && add_bytes( tail.data(), tail.size() );
+        }
+    }
+    return false;
 }
 
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
+// 响应追加在已经排队的响应后面：响应头写在写缓冲区的m_write_idx之后，内存块追加到m_iv的末尾
 bool http_conn::process_write(HTTP_CODE ret) {
+    int start = m_write_idx;   // 这个响应在写缓冲区中的起始位置
     switch (ret)
     {
         case INTERNAL_ERROR:
-            add_status_line( 500, error_500_title );
-            add_headers( strlen( error_500_form ) );
-            if ( ! add_content( error_500_form ) ) {
+            m_linger = false;
+            if ( ! add_error( 500 ) ) {
                 return false;
             }
             break;
         case BAD_REQUEST:
-            add_status_line( 400, error_400_title );
-            add_headers( strlen( error_400_form ) );
-            if ( ! add_content( error_400_form ) ) {
+            // 请求可能没有解析完，找不到下一个请求从哪里开始，发完就关闭连接
+            m_linger = false;
+            if ( ! add_error( 400 ) ) {
                 return false;
             }
             break;
         case NO_RESOURCE:
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) {
+            if ( ! add_error( 404 ) ) {
                 return false;
             }
             break;
         case FORBIDDEN_REQUEST:
-            add_status_line( 403, error_403_title );
-            add_headers(strlen( error_403_form));
-            if ( ! add_content( error_403_form ) ) {
+            if ( ! add_error( 403 ) ) {
+                return false;
+            }
+            break;
+        case HEADERS_TOO_LARGE:
+            // 请求没有收完，后面的数据没法再当成下一个请求，发完就关闭连接
+            m_linger = false;
+            if ( ! add_error( 431 ) ) {
+                return false;
+            }
+            break;
+        case ENTITY_TOO_LARGE:
+            m_linger = false;
+            if ( ! add_error( 413 ) ) {
+                return false;
+            }
+            break;
+        case NOT_MODIFIED: {
+            // 304没有内容，响应头和200的一样带上验证用的头部，让客户端更新它缓存的那一份
+            const file_entry* file = m_response ? m_response -> file : m_file;
+            if ( ! ( add_status_line( 304 ) && add_validators( file ) && add_linger() && add_blank_line() ) ) {
                 return false;
             }
             break;
-        case FILE_REQUEST:
-            add_status_line(200, ok_200_title );
-            add_headers(m_file_stat.st_size);
-            m_iv[ 0 ].iov_base = m_write_buf;
-            m_iv[ 0 ].iov_len = m_write_idx;
-            m_iv[ 1 ].iov_base = m_file_address;
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
-            return true;
+        }
+        case FILE_REQUEST: {
+            // 状态行和Date每次都要现生成，后面的响应头和文件内容可以缓存
+            if ( ! add_status_line( 200 ) ) {
+                return false;
+            }
+            int head = m_write_idx;
+            if ( !m_response ) {
+                if ( ! add_headers( m_file -> st.st_size ) ) {
+                    return false;
+                }
+                // 小文件把响应头和文件内容拼起来放进响应缓存，下次同样的请求直接发
+                m_response = response_cache :: get_instance() -> insert( m_path.c_str(), m_linger, m_write_buf + head, m_write_idx - head, m_file );
+                if ( m_response ) {
+                    m_write_idx = head;
+                }
+            }
+            m_iv[ m_iv_next + m_iv_count ].iov_base = m_write_buf + start;
+            m_iv[ m_iv_next + m_iv_count ].iov_len = m_write_idx - start;
+            m_iv_count++;
+            if ( m_response ) {
+                // 响应头和文件内容在缓存里的一块连续内存中，和状态行一起一次发完
+                m_iv[ m_iv_next + m_iv_count ].iov_base = m_response -> data;
+                m_iv[ m_iv_next + m_iv_count ].iov_len = m_response -> len;
+                m_iv_count++;
+                bytes_to_send += m_write_idx - start + m_response -> len;
+                break;
+            }
+            if ( m_file -> address ) {
+                // 小文件已经mmap在缓存里了，和响应头一起一次sendmsg发出去
+                m_iv[ m_iv_next + m_iv_count ].iov_base = m_file -> address;
+                m_iv[ m_iv_next + m_iv_count ].iov_len = m_file -> st.st_size;
+                m_iv_count++;
+            }
+            else if ( m_file -> st.st_size > 0 ) {
+                // 大文件在write()里用sendfile从缓存中打开的fd发，每个连接有自己的偏移，互不影响
+                m_file_fd = m_file -> fd;
+                m_file_offset = 0;
+                m_readahead = 0;
+            }
+            bytes_to_send += m_write_idx - start + m_file -> st.st_size;
+            break;
+        }
         default:
             return false;
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
+    if ( ret != FILE_REQUEST ) {
+        m_iv[ m_iv_next + m_iv_count ].iov_base = m_write_buf + start;
+        m_iv[ m_iv_next + m_iv_count ].iov_len = m_write_idx - start;
+        m_iv_count++;
+        bytes_to_send += m_write_idx - start;
+    }
+
+    // 这个响应用到的缓存项，整批响应发完之前都不能还回去
+    m_held_files[ m_held_count ] = m_file;
+    m_held_responses[ m_held_count ] = m_response;
+    m_held_count++;
+    m_file = NULL;
+    m_response = NULL;
+    m_write_linger = m_linger;
     return true;
 }
 
@@ -556,14 +1073,23 @@ void http_conn :: process() {
     // 生成响应
     bool write_ret = process_write(read_ret);
     if (!write_ret) {
-        close_conn();
+        shutdown_conn();
+        return;
     }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
-
-}    
-
-
-
-
 
+    // 流水线：客户端不等响应就连着发了几个请求，读缓冲区里后面的请求接着处理，
+    // 响应都排在m_iv里，最后一次sendmsg一起发出去，不用每个请求都走一遍epoll_ctl、epoll_wait和sendmsg
+    while (can_pipeline()) {
+        next_request();
+        read_ret = process_read();
+        if (read_ret == NO_REQUEST) {
+            break;   // 后面的请求还没收全，先把前面的响应发了
+        }
+        if (!process_write(read_ret)) {
+            shutdown_conn();
+            return;
+        }
+    }
+    modfd(m_epollfd, m_sockfd, EPOLLOUT);
 
+}
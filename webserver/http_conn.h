@@ -13,22 +13,35 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
-#include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "file_cache.h"
+#include "response_cache.h"
+#include "crlf_scan.h"
+#include "http_header.h"
+#include "buffer_pool.h"
+#include "lst_timer.h"
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <string.h>
+#include <atomic>
+#include <string>
 
 
 class http_conn {
 
 public:
 
-    static int m_epollfd;    // 设计为静态变量，即所有的http_conn实例共用这一个变量，即所有的连接socket都被注册到一个epoll对象上
-    static int m_user_count;   // 统计用户的数量
-    static const int READ_BUFFER_SIZE = 2048;  // 读缓冲的大小
+    static std :: atomic<int> m_user_count;   // 统计用户的数量，多个reactor线程同时增减，所以用原子变量
+    static int m_max_header_size;              // 请求行加上所有头部最多的字节数，超过了回复431
+    static int m_idle_timeout;                 // 保持的连接空闲多少秒后关闭
+    static int m_max_requests;                 // 一个连接上最多处理的请求数，0表示不限制
     static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲的大小
-    static const int FILENAME_LEN = 200;        // 文件名的最大长度
+    static const int CRLF_BATCH = 64;           // 一次扫描最多记下的行边界个数
+    static const int MAX_HEADERS = 64;          // 一个请求最多的头部个数
+    static const int MAX_PIPELINE = 16;         // 流水线上的请求一次最多合并发送的响应个数
+    static const int PIPELINE_WRITE_RESERVE = 512;   // 写缓冲至少还剩这么多，才接着处理流水线上的下一个请求
+    static const int STREAM_WINDOW = 1 << 20;   // 大文件一次最多sendfile这么多，并提前一个窗口让内核预读
 
     // HTTP请求方法，这里只支持GET
     enum METHOD { GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT };
@@ -55,6 +68,9 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        HEADERS_TOO_LARGE   :   请求行和头部超过了m_max_header_size
+        ENTITY_TOO_LARGE    :   请求体太大，整个请求放不进最大的读缓冲区
+        NOT_MODIFIED        :   条件请求中客户端缓存的文件还是最新的，回复不带内容的304
     */
     enum HTTP_CODE {
       NO_REQUEST,
@@ -64,30 +80,39 @@ public:
       FORBIDDEN_REQUEST,
       FILE_REQUEST,
       INTERNAL_ERROR,
-      CLOSED_CONNECTION
+      CLOSED_CONNECTION,
+      HEADERS_TOO_LARGE,
+      ENTITY_TOO_LARGE,
+      NOT_MODIFIED
     };
 
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
 
+    // write()的结果：1.出错或者不保持连接，要关闭 2.发完了或者还要等下一次EPOLLOUT 3.发完了，读缓冲区里还有流水线上的请求，要交给工作线程去处理
+    enum WRITE_STATUS { WRITE_CLOSE = 0, WRITE_OK, WRITE_PROCESS };
+
     http_conn() {}
     ~http_conn() {}
 
     // 工作线程的实际处理
     void process();
 
-    // 初始化新接受的客户端的连接
-    void init(int sockfd, const sockaddr_in & addr); 
+    // 初始化新接受的客户端的连接，epollfd和timers是接受这个连接的reactor线程自己的epoll对象和时间轮
+    void init(int sockfd, const sockaddr_in & addr, int epollfd, time_wheel* timers); 
 
-    // 关闭连接
+    // 关闭连接，只能在连接所属的reactor线程里调用，因为要把定时器从它的时间轮上摘下来
     void close_conn();
 
+    // 连接上有读写，空闲超时重新计时，也只能在所属的reactor线程里调用
+    void refresh_timer();
+
     // 非阻塞的读
     bool read(); 
 
     // 非阻塞的写
-    bool write(); 
+    WRITE_STATUS write(); 
 
     HTTP_CODE process_read();    // 解析HTTP请求
     bool process_write( HTTP_CODE ret );    // 填充HTTP应答
@@ -99,42 +124,73 @@ public:
 
     LINE_STATUS parse_line(); 
     char* get_line()  { return m_read_buf + m_start_line; }    
+
+    // 取请求中某个认识的头部的值，len返回值的长度，请求中没有这个头部时返回NULL
+    const char* get_header(HEADER_ID id, int* len) const;
     HTTP_CODE do_request();
+    bool not_modified(const file_entry* file) const;   // 条件请求的If-None-Match/If-Modified-Since是否表明客户端的缓存还有效
 
 
+    // 生成响应中固定不变的部分(错误页面、保持连接的头部)，解析完启动参数后调用一次
+    static void init_responses();
+
     // 这一组函数被process_write调用以填充HTTP应答。
-    void unmap();
-    bool add_response( const char* format, ... );
-    bool add_content( const char* content );
+    void close_file();
+    bool add_bytes( const char* data, int len );
     bool add_content_type();
-    bool add_status_line( int status, const char* title );
-    bool add_headers( int content_length );
-    bool add_content_length( int content_length );
+    bool add_validators( const file_entry* file );
+    bool add_status_line( int status );
+    bool add_headers( off_t content_length );
+    bool add_content_length( off_t content_length );
     bool add_linger();
     bool add_blank_line();
+    bool add_error( int status );
 
 private:
+    int m_epollfd;   // 该连接所属reactor的epoll对象，多reactor模式下每个线程一个，所以不再是所有连接共用的静态变量
+    time_wheel* m_timers;    // 该连接所属reactor的时间轮
+    util_timer m_timer;      // 空闲超时的定时器
+    int m_request_count;     // 这个连接上已经处理的请求数
     int m_sockfd;  // 该http连接的socket
     sockaddr_in m_address;   // 通信的socket地址
-    char m_read_buf[READ_BUFFER_SIZE];   // 读缓冲区
+    char* m_read_buf;      // 读缓冲区，从buffer_pool中取，放不下时换成大一号的，请求处理完还回去
+    int m_read_size;       // 读缓冲区的大小，最后一个字节总是留给'\0'
     int m_read_idx;  // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
 
     int m_checked_index;   // 当前正在分析的字符在读缓冲区的位置
     int m_start_line;      // 当前正在解析的行的起始位置
+    int m_crlf[CRLF_BATCH];   // 扫描读缓冲区预先找出来的'\r'和'\n'的位置，parse_line按顺序取用
+    int m_crlf_count;         // m_crlf中有效的个数
+    int m_crlf_next;          // 下一个要用的边界在m_crlf中的下标
+    int m_scanned_idx;        // 读缓冲区中这个位置之前的数据都已经扫描过了
+    int m_request_end;        // 当前请求在读缓冲区中的结束位置，后面是流水线上的下一个请求；请求还没收全时为-1
     char* m_url;           // 请求目标文件的文件名
+    std :: string m_path;  // 规范化后的m_url，查缓存都用它
     char* m_version;       // 协会版本， 只支持HTTP1.1
     METHOD m_method;       // 请求方法
-    char* m_host;          // 主机名
     int m_content_length;  // HTTP请求的消息总长度
-    bool m_linger;         // HTTP请求是否要保持连接
+    bool m_linger;         // HTTP请求是否要保持连接，HTTP/1.1默认保持，HTTP/1.0要带Connection: keep-alive
+
+    http_header m_headers[MAX_HEADERS];   // 请求中所有的头部，名字和值都指向读缓冲区，不拷贝
+    int m_header_count;                   // m_headers中的个数
+    int m_known_headers[HEADER_COUNT];    // 认识的头部在m_headers中的下标，请求中没有的是-1
 
-    char m_real_file[ FILENAME_LEN ];       // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
     char m_write_buf[ WRITE_BUFFER_SIZE ];  // 写缓冲区
-    int m_write_idx;                        // 写缓冲区中待发送的字节数
-    char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置
-    struct stat m_file_stat;                // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
-    int m_iv_count;
+    int m_write_idx;                        // 写缓冲区中待发送的字节数，流水线上的几个响应头依次排在里面
+    file_entry* m_file;                     // 客户请求的目标文件在文件缓存中的项，里面有打开的fd、文件状态和mmap的地址
+    cached_response* m_response;            // 缓存中已经拼好的完整响应，命中时直接把它发出去
+    file_entry* m_held_files[MAX_PIPELINE];               // 已经排进m_iv的响应用到的缓存项，整批发完之前持有它们的引用
+    cached_response* m_held_responses[MAX_PIPELINE];
+    int m_held_count;                       // 排队等待发送的响应个数
+    bool m_write_linger;                    // 排在最后的那个响应发完后是否保持连接
+    int m_file_fd;                          // 要用sendfile发送的文件的描述符，文件内容直接从它发出去，没有文件要sendfile时为-1
+    off_t m_file_offset;                    // 文件已经发送到的位置，sendfile会自动推进它，EAGAIN之后从这里接着发
+    off_t m_readahead;                      // 已经让内核预读到的文件位置
+    struct iovec m_iv[2 * MAX_PIPELINE];    // 内存中待发送的数据块(响应行、响应头、错误页面)，用sendmsg一次发出，每个响应最多两块
+    int m_iv_count;                         // 还没发完的内存块的数量
+    int m_iv_next;                          // 下一个要发的内存块在m_iv中的下标
+    off_t bytes_to_send;                    // 响应中还没有发送的字节数, 包括内存块和文件，文件可能超过2GB
+    off_t bytes_have_send;                  // 响应中已经发送的字节数
 
     CHECK_STATE m_check_state;   // 主状态机当前所处的状态
 
@@ -142,6 +198,15 @@ private:
 
 
     void init();     // 初始化连接其余的信息
+    void shutdown_conn();       // 在工作线程里要关闭连接时，只关掉socket的读写，由reactor收到EPOLLHUP后去关闭
+    static void idle_timeout(http_conn* conn);   // 空闲超时的回调
+    void init_request();        // 准备解析下一个请求，读缓冲区里的数据不动
+    void init_write();          // 清空发送的状态
+    void next_request();        // 当前请求处理完了，把读缓冲区里剩下的数据挪到开头
+    bool can_pipeline() const;  // 是否接着处理读缓冲区里流水线上的下一个请求，响应和前面的一起发
+    WRITE_STATUS write_done();  // 排队的响应都发完了，关闭连接、等下一个请求或者让工作线程接着处理缓冲区里的请求
+    bool grow_read_buf();       // 读缓冲区满了，换一块大一号的
+    void release_read_buf();    // 把读缓冲区还给buffer_pool
     
 
     
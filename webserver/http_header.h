@@ -0,0 +1,132 @@
+#ifndef HTTP_HEADER_H
+#define HTTP_HEADER_H
+
+#include <strings.h>
+
+// 服务器认识的请求头，解析时用完美哈希一次就能判断出是哪一个
+enum HEADER_ID {
+    HEADER_CONNECTION = 0,
+    HEADER_CONTENT_LENGTH,
+    HEADER_HOST,
+    HEADER_KEEP_ALIVE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_EXPECT,
+    HEADER_RANGE,
+    HEADER_IF_RANGE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_USER_AGENT,
+    HEADER_REFERER,
+    HEADER_COOKIE,
+    HEADER_COUNT,              // 认识的请求头的个数
+    HEADER_UNKNOWN = -1        // 不认识的请求头
+};
+
+// 和HEADER_ID一一对应
+constexpr const char* header_names[HEADER_COUNT] = {
+    "Connection",
+    "Content-Length",
+    "Host",
+    "Keep-Alive",
+    "Transfer-Encoding",
+    "Expect",
+    "Range",
+    "If-Range",
+    "If-None-Match",
+    "If-Modified-Since",
+    "Accept",
+    "Accept-Encoding",
+    "Accept-Language",
+    "User-Agent",
+    "Referer",
+    "Cookie",
+};
+
+// 请求中的一个头部，名字和值都是读缓冲区里的偏移，不拷贝字符串，缓冲区换了位置也还有效
+struct http_header {
+    int name;         // 名字在读缓冲区中的起始位置
+    int name_len;
+    int value;        // 值在读缓冲区中的起始位置，已经去掉了前后的空白
+    int value_len;
+    HEADER_ID id;     // 认识的头部是哪一个，不认识的是HEADER_UNKNOWN
+};
+
+// 头部名字的完美哈希
+// 名字不区分大小写，所以哈希时把每个字节都或上0x20 (对字母来说就是转成小写)
+// 编译期从0开始试种子，直到所有认识的名字落在哈希表中不同的槽里，这样查找时算一次哈希、比较一次字符串就够了
+constexpr int HEADER_TABLE_SIZE = 64;   // 2的幂，比认识的头部个数大不少，容易找到种子
+constexpr unsigned HEADER_MAX_SEED = 100000;
+
+constexpr unsigned header_hash(const char* s, int len, unsigned seed) {
+    unsigned h = 2166136261u ^ seed;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)(s[i] | 0x20)) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+constexpr int header_name_length(const char* s) {
+    int n = 0;
+    while (s[n]) {
+        n++;
+    }
+    return n;
+}
+
+// 用这个种子时，有没有两个认识的名字落在同一个槽里
+constexpr bool header_hash_collides(unsigned seed) {
+    bool used[HEADER_TABLE_SIZE] = {};
+    for (int i = 0; i < HEADER_COUNT; i++) {
+        unsigned slot = header_hash(header_names[i], header_name_length(header_names[i]), seed) & (HEADER_TABLE_SIZE - 1);
+        if (used[slot]) {
+            return true;
+        }
+        used[slot] = true;
+    }
+    return false;
+}
+
+constexpr unsigned find_header_hash_seed() {
+    for (unsigned seed = 0; seed < HEADER_MAX_SEED; seed++) {
+        if (!header_hash_collides(seed)) {
+            return seed;
+        }
+    }
+    return HEADER_MAX_SEED;
+}
+
+struct header_table {
+    int slots[HEADER_TABLE_SIZE];   // 槽 -> HEADER_ID，空槽是-1
+    int lengths[HEADER_COUNT];      // 每个名字的长度
+};
+
+constexpr header_table make_header_table(unsigned seed) {
+    header_table t = {};
+    for (int i = 0; i < HEADER_TABLE_SIZE; i++) {
+        t.slots[i] = -1;
+    }
+    for (int i = 0; i < HEADER_COUNT; i++) {
+        t.lengths[i] = header_name_length(header_names[i]);
+        t.slots[header_hash(header_names[i], t.lengths[i], seed) & (HEADER_TABLE_SIZE - 1)] = i;
+    }
+    return t;
+}
+
+constexpr unsigned header_hash_seed = find_header_hash_seed();
+static_assert(header_hash_seed < HEADER_MAX_SEED, "no perfect hash seed for the known header names, enlarge HEADER_TABLE_SIZE");
+
+constexpr header_table known_headers = make_header_table(header_hash_seed);
+
+// 查找名字对应的HEADER_ID，不认识的返回HEADER_UNKNOWN
+inline HEADER_ID lookup_header(const char* name, int len) {
+    int id = known_headers.slots[header_hash(name, len, header_hash_seed) & (HEADER_TABLE_SIZE - 1)];
+    if (id < 0 || known_headers.lengths[id] != len || strncasecmp(name, header_names[id], len) != 0) {
+        return HEADER_UNKNOWN;
+    }
+    return (HEADER_ID)id;
+}
+
+#endif
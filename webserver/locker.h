@@ -38,6 +38,39 @@ private:
     pthread_mutex_t m_mutex;
 };
 
+// 读写锁类, 读多写少的共享数据用它，多个读者可以同时拿到锁
+class rwlocker {
+
+public:
+    rwlocker() {
+        if (pthread_rwlock_init(&m_rwlock, NULL) != 0) {
+            throw std ::exception();
+        }
+    }
+
+    ~rwlocker() {
+        pthread_rwlock_destroy(&m_rwlock);
+    }
+
+    // 加读锁
+    bool rdlock() {
+        return pthread_rwlock_rdlock(&m_rwlock) == 0;
+    }
+
+    // 加写锁
+    bool wrlock() {
+        return pthread_rwlock_wrlock(&m_rwlock) == 0;
+    }
+
+    bool unlock() {
+        return pthread_rwlock_unlock(&m_rwlock) == 0;
+    }
+
+private:
+
+    pthread_rwlock_t m_rwlock;
+};
+
 // 条件变量类
 class cond {
 public:
@@ -0,0 +1,170 @@
+#ifndef LST_TIMER_H
+#define LST_TIMER_H
+
+#include <time.h>
+#include <stddef.h>
+
+class http_conn;
+
+// 定时器直接嵌在http_conn里，随连接一起分配，不用每个连接new一个
+class util_timer {
+public:
+    util_timer() : prev(NULL), next(NULL) {}
+
+public:
+    time_t expire;                      // 超时时间，绝对时间
+    void (*cb_func)(http_conn*);        // 超时后的回调函数
+    http_conn* user_data;
+    util_timer* prev;                   // 槽中的前一个定时器，不在时间轮上时为NULL
+    util_timer* next;                   // 槽中的后一个定时器
+};
+
+// 分层时间轮，和noactive/lst_timer.h里的一样：第0层256个槽，每槽1秒；往上每层64个槽，每槽是下一层转一圈的时间
+// 定时器按超时时间直接挂到对应的槽上，增、删、调整都是O(1)；tick()只处理到期的槽，远处的定时器在低一层转完一圈时才搬(cascade)下来
+// 每个reactor线程一个，只在自己的线程里用，所以不加锁；定时器由连接持有，时间轮只负责把它们串起来
+class time_wheel {
+public:
+    time_wheel() : cur_time(0), count(0) {
+        // 每个槽的头结点是一个哨兵，空槽的prev和next都指向自己
+        for (int i = 0; i < SLOTS_0; ++i) {
+            slots0[i].prev = slots0[i].next = &slots0[i];
+        }
+        for (int i = 0; i < LEVELS - 1; ++i) {
+            for (int j = 0; j < SLOTS; ++j) {
+                slots[i][j].prev = slots[i][j].next = &slots[i][j];
+            }
+        }
+    }
+
+    // 已经在时间轮上的定时器不会重复添加
+    void add_timer(util_timer* timer) {
+        if (!timer || timer -> prev) {
+            return;
+        }
+        if (count == 0) {
+            // 轮子是空的，可能很久没转了，先把当前时间对上
+            cur_time = time(NULL);
+        }
+        link(timer);
+        count++;
+    }
+
+    // 超时时间延长或缩短都可以，不在时间轮上的就加进来
+    void adjust_timer(util_timer* timer) {
+        if (!timer) {
+            return;
+        }
+        if (!timer -> prev) {
+            add_timer(timer);
+            return;
+        }
+        unlink(timer);
+        link(timer);
+    }
+
+    // 已经到期或者已经删掉的定时器什么也不做
+    void del_timer(util_timer* timer) {
+        if (!timer || !timer -> prev) {
+            return;
+        }
+        unlink(timer);
+        count--;
+    }
+
+    // 每次epoll_wait返回后调用，处理从上次到现在到期的定时器
+    void tick() {
+        time_t cur = time(NULL);
+        if (count == 0) {
+            cur_time = cur + 1;
+            return;
+        }
+        while (cur_time <= cur) {
+            int idx = cur_time & (SLOTS_0 - 1);
+            if (idx == 0) {
+                // 第0层转完一圈，把上一层当前槽搬下来，上一层也转完一圈就继续往上
+                for (int level = 1; level < LEVELS; ++level) {
+                    int i = (cur_time >> (SLOT_BITS_0 + (level - 1) * SLOT_BITS)) & (SLOTS - 1);
+                    cascade(level, i);
+                    if (i != 0) {
+                        break;
+                    }
+                }
+            }
+
+            util_timer* head = &slots0[idx];
+            while (head -> next != head) {
+                util_timer* tmp = head -> next;
+                unlink(tmp);
+                count--;
+                tmp -> cb_func(tmp -> user_data);
+            }
+            cur_time++;
+        }
+    }
+
+    // epoll_wait的超时时间(毫秒)，没有定时器时一直等
+    int get_timeout() const {
+        return count == 0 ? -1 : 1000;
+    }
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS_0 = 8;
+    static const int SLOTS_0 = 1 << SLOT_BITS_0;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+
+    // 按超时时间挂到对应层的槽上，已经过期的挂到当前槽，下一次tick就处理
+    void link(util_timer* timer) {
+        time_t expire = timer -> expire;
+        if (expire < cur_time) {
+            expire = cur_time;
+        }
+        time_t delta = expire - cur_time;
+        util_timer* head;
+        if (delta < SLOTS_0) {
+            head = &slots0[expire & (SLOTS_0 - 1)];
+        }
+        else {
+            int level = 1;
+            int shift = SLOT_BITS_0;
+            while (level < LEVELS - 1 && delta >= ((time_t)1 << (shift + SLOT_BITS))) {
+                level++;
+                shift += SLOT_BITS;
+            }
+            // 超出了最高层的范围，先挂在最远的槽上
+            if (delta >= ((time_t)1 << (shift + SLOT_BITS))) {
+                expire = cur_time + ((time_t)1 << (shift + SLOT_BITS)) - 1;
+            }
+            head = &slots[level - 1][(expire >> shift) & (SLOTS - 1)];
+        }
+        timer -> next = head;
+        timer -> prev = head -> prev;
+        head -> prev -> next = timer;
+        head -> prev = timer;
+    }
+
+    void unlink(util_timer* timer) {
+        timer -> prev -> next = timer -> next;
+        timer -> next -> prev = timer -> prev;
+        timer -> prev = timer -> next = NULL;
+    }
+
+    // 把第level层第idx个槽上的定时器重新挂一遍，它们会落到低一层去
+    void cascade(int level, int idx) {
+        util_timer* head = &slots[level - 1][idx];
+        while (head -> next != head) {
+            util_timer* tmp = head -> next;
+            unlink(tmp);
+            link(tmp);
+        }
+    }
+
+private:
+    util_timer slots0[SLOTS_0];
+    util_timer slots[LEVELS - 1][SLOTS];
+    time_t cur_time;   // 下一个要处理的秒
+    int count;         // 时间轮上定时器的个数
+};
+
+#endif
@@ -8,13 +8,17 @@
 #include <error.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <pthread.h>
 #include "locker.h"
 #include "threadpool.h"
 #include <signal.h>
 #include "http_conn.h"
+#include "lst_timer.h"
 
 #define MAX_FD 65535  // 最大的文件描述数个数
 #define MAX_EVENT_NUMBER 10000   // 监听的最大的事件数
+#define MAX_REACTOR_NUMBER 64    // reactor线程的最大个数
+#define RESPONSE_CACHE_SIZE (16 * 1024 * 1024)   // 小文件响应缓存默认的总大小
 
 // 添加信号捕捉
 void addsig(int sig, void(*handler)(int)){
@@ -34,60 +38,73 @@ extern void removefd(int epollfd, int fd);
 // 修改文件描述符
 extern void modfd(int epollfd, int fd, int ev);
 
-int main(int argc, char* argv[]) {
-
-    if (argc <= 1) {
-        printf("按照如下格式运行：%s port_number\n", basename(argv[0]));
-        exit(-1);
-    }
-    
-    // 获取端口号
-    int port = atoi(argv[1]); // 字符串数字转换成整数
-
-    // 对SIGPIPE信号进行处理
-    addsig(SIGPIPE, SIG_IGN); // SIGPIPE信号，默认情况下，会终止进程，这里我们是设为ignore，忽略它，什么都不做，程序正常进行，要不然，开启的这个服务器程序会闪退
-
-    // 创建线程池，初始化线程池
-    threadpool<http_conn> * pool = NULL;
-    try{
-        pool = new threadpool<http_conn>;
-    }
-    catch (...){
-        exit(-1);
-    }
-
-    // 创建一个数组用于保存所有的客户端信息, users中每一个元素就是一个客户端的连接
-    http_conn* users = new http_conn[MAX_FD];
+// 网站的根目录, 在http_conn.cpp中定义
+extern const char* doc_root;
 
+// 创建监听socket
+// 每个reactor线程都有一个自己的监听socket，设置SO_REUSEPORT之后它们可以绑定在同一个端口上，
+// 由内核把新连接均匀地分给各个socket，这样accept就不会都挤在一个线程里，也没有惊群
+int create_listenfd(int port) {
     int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        return -1;
+    }
 
     // 设置端口复用
     // 1.防止服务器重启时之前绑定的端口还没释放 2.程序突然退出而系统没有释放端口
     // 针对的是服务器端socket的time_wait状态
     int reuse = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
 
     // 绑定 
     struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(port); // 主机序转变为网络序
-    bind(listenfd, (struct sockaddr*)&address, sizeof(address));
+    if (bind(listenfd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(listenfd);
+        return -1;
+    }
 
     // 监听
     listen(listenfd, 5);  // 5是未连接的请求和已经连接的请求的和的最大值,可以 cat /proc/sys/net/core/somaxconn查看，本机是4096
                           // 但是一般设为5就够了，因为连接上的请求，accept会立即将它取走
+    return listenfd;
+}
 
-    // 创建epoll对象，事件数组， 添加监听的文件描述符
-    epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5); 
+// 一个reactor线程需要的东西
+struct reactor {
+    int listenfd;                    // 自己的监听socket
+    int epollfd;                     // 自己的epoll对象
+    threadpool<http_conn>* pool;     // 所有reactor共用一个线程池
+    http_conn* users;                // 所有reactor共用一个连接数组，下标是fd，fd在进程内是唯一的，所以每个reactor只会碰到属于自己的那一部分
+    time_wheel* timers;              // 自己的时间轮，管理自己的连接的空闲超时
+};
 
-    // 将监听的文件描述符添加到epoll对象中
-    addfd(epollfd, listenfd, false);
-    http_conn :: m_epollfd = epollfd;   // 哈哈哈, 还是将上面的listenfd加进来了，我以为不加呢，那这样的话，整个服务器端就一个epollfd
+// 打印响应缓存的命中、未命中、淘汰次数和占用的字节数
+void print_cache_stats() {
+    response_cache* cache = response_cache :: get_instance();
+    printf("response cache: %lu hits, %lu misses, %lu evictions, %ld bytes\n",
+           cache -> hits(), cache -> misses(), cache -> evictions(), cache -> bytes());
+}
+
+// reactor线程的事件循环, 即原来main里的while(true)
+void* reactor_loop(void* arg) {
+    reactor* r = (reactor*)arg;
+    int listenfd = r -> listenfd;
+    int epollfd = r -> epollfd;
+    http_conn* users = r -> users;
+    threadpool<http_conn>* pool = r -> pool;
+    time_wheel* timers = r -> timers;
+
+    // 事件数组
+    epoll_event events[MAX_EVENT_NUMBER];
 
     while(true) {
-        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1); // 检测到的事件的个数，这里是-1表示阻塞的
+        // 检测到的事件的个数，有连接时最多等1秒，回来转时间轮，关掉空闲太久的连接；没有连接时一直阻塞
+        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, timers -> get_timeout());
         if ((num < 0) && (errno != EINTR)) {
             printf("epoll failure\n");
             break;
@@ -98,18 +115,24 @@ int main(int argc, char* argv[]) {
             int sockfd = events[i].data.fd;
             if (sockfd == listenfd) {
                 // 有客户端连接进来
-                struct sockaddr_in client_address;
-                socklen_t client_addrlen = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addrlen);
-
-                if (http_conn:: m_user_count >= MAX_FD) {
-                    // 服务器目前很忙，连接数满了
-                    close(connfd); // 所以将这个连接关闭
-                    continue;
-                }
+                // listenfd是边缘触发的，所以要一直accept到EAGAIN为止，否则同时到来的连接会漏掉
+                while (true) {
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlen = sizeof(client_address);
+                    int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addrlen);
+                    if (connfd < 0) {
+                        break;
+                    }
+
+                    if (http_conn:: m_user_count >= MAX_FD) {
+                        // 服务器目前很忙，连接数满了
+                        close(connfd); // 所以将这个连接关闭
+                        continue;
+                    }
 
-                // 要将新的客户的数据初始化，放到数组中
-                users[connfd].init(connfd, client_address);
+                    // 要将新的客户的数据初始化，放到数组中，连接注册到当前reactor的epoll上
+                    users[connfd].init(connfd, client_address, epollfd, timers);
+                }
             }
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
                 // 对方异常断开或者错误等事件
@@ -120,7 +143,11 @@ int main(int argc, char* argv[]) {
                 // 有读事件发生
                 if (users[sockfd].read()) {
                     // 一次性把所有数据读完
-                    pool -> append(users + sockfd);
+                    users[sockfd].refresh_timer();
+                    if (!pool -> append(users + sockfd)) {
+                        // 请求队列满了，这个连接等不到处理，直接关掉
+                        users[sockfd].close_conn();
+                    }
                 }
                 else{
                     users[sockfd].close_conn();
@@ -128,15 +155,161 @@ int main(int argc, char* argv[]) {
             }
             else if (events[i].events & EPOLLOUT) {
                 // 有写事件发生
-                if (!users[sockfd].write()) {
+                http_conn :: WRITE_STATUS ret = users[sockfd].write();
+                if (ret == http_conn :: WRITE_CLOSE) {
                     users[sockfd].close_conn();
                 }
+                else {
+                    users[sockfd].refresh_timer();
+                    // 流水线上还有没处理的请求，和EPOLLIN一样交给工作线程
+                    if (ret == http_conn :: WRITE_PROCESS && !pool -> append(users + sockfd)) {
+                        users[sockfd].close_conn();
+                    }
+                }
+            }
+        }
+        timers -> tick();
+
+        // 每隔一段时间打印一次缓存的统计信息，几个reactor里只有一个会打印
+        if (response_cache :: get_instance() -> stats_due(time(NULL))) {
+            print_cache_stats();
+        }
+    }
+
+    return r;
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc <= 1) {
+        printf("按照如下格式运行：%s port_number [-r reactor_number] [-c response_cache_bytes] [-H max_header_bytes] [-k idle_timeout] [-m max_requests] [-C url_prefix=cache_control ...]\n", basename(argv[0]));
+        exit(-1);
+    }
+    
+    // 获取端口号
+    int port = atoi(argv[1]); // 字符串数字转换成整数
+
+    // 解析可选参数
+    // -r reactor的个数，每个reactor一个线程，有自己的监听socket和epoll对象，默认1个，即原来的单reactor
+    // -c 小文件响应缓存的总字节数，0表示不缓存
+    // -H 请求行加上所有头部最多的字节数，超过了回复431
+    // -k 保持的连接空闲多少秒后关闭
+    // -m 一个连接上最多处理的请求数，0表示不限制
+    // -C url以url_prefix开头的文件带上Cache-Control: cache_control，可以给多次，比如 -C /images/=max-age=86400
+    int reactor_number = 1;
+    long response_cache_bytes = RESPONSE_CACHE_SIZE;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "r:c:H:k:m:C:")) != -1) {
+        switch (opt) {
+            case 'r':
+                reactor_number = atoi(optarg);
+                break;
+            case 'c':
+                response_cache_bytes = atol(optarg);
+                break;
+            case 'H':
+                http_conn :: m_max_header_size = atoi(optarg);
+                break;
+            case 'k':
+                http_conn :: m_idle_timeout = atoi(optarg);
+                break;
+            case 'm':
+                http_conn :: m_max_requests = atoi(optarg);
+                break;
+            case 'C': {
+                char* value = strchr(optarg, '=');
+                if (!value || value == optarg) {
+                    printf("-C 的格式是 url_prefix=cache_control\n");
+                    exit(-1);
+                }
+                *value++ = '\0';
+                if (!file_cache :: get_instance() -> add_cache_control(optarg, value)) {
+                    printf("cache_control 不能超过 %d 个字符\n", file_cache :: CACHE_CONTROL_MAX);
+                    exit(-1);
+                }
+                break;
             }
+            default:
+                printf("按照如下格式运行：%s port_number [-r reactor_number] [-c response_cache_bytes] [-H max_header_bytes] [-k idle_timeout] [-m max_requests] [-C url_prefix=cache_control ...]\n", basename(argv[0]));
+                exit(-1);
+        }
+    }
+    if (reactor_number <= 0 || reactor_number > MAX_REACTOR_NUMBER) {
+        printf("reactor_number 需要在 1 到 %d 之间\n", MAX_REACTOR_NUMBER);
+        exit(-1);
+    }
+    // 头部的限制要比最大的读缓冲区小，否则头部太大时缓冲区先满了，分不清是431还是413
+    if (http_conn :: m_max_header_size < 1024 || http_conn :: m_max_header_size > buffer_pool :: MAX_SIZE / 2) {
+        printf("max_header_bytes 需要在 1024 到 %d 之间\n", buffer_pool :: MAX_SIZE / 2);
+        exit(-1);
+    }
+    if (http_conn :: m_idle_timeout <= 0 || http_conn :: m_max_requests < 0) {
+        printf("idle_timeout 需要大于0，max_requests 不能小于0\n");
+        exit(-1);
+    }
+
+    // 参数确定之后，把错误页面等固定的响应预先生成好
+    http_conn :: init_responses();
+
+    // 对SIGPIPE信号进行处理
+    addsig(SIGPIPE, SIG_IGN); // SIGPIPE信号，默认情况下，会终止进程，这里我们是设为ignore，忽略它，什么都不做，程序正常进行，要不然，开启的这个服务器程序会闪退
+
+    // 初始化文件缓存，监听网站根目录下文件的变化
+    if (!file_cache :: get_instance() -> init(doc_root)) {
+        printf("file cache init failure\n");
+        exit(-1);
+    }
+    response_cache :: get_instance() -> init(response_cache_bytes);
+
+    // 创建线程池，初始化线程池
+    threadpool<http_conn> * pool = NULL;
+    try{
+        pool = new threadpool<http_conn>;
+    }
+    catch (...){
+        exit(-1);
+    }
+
+    // 创建一个数组用于保存所有的客户端信息, users中每一个元素就是一个客户端的连接
+    http_conn* users = new http_conn[MAX_FD];
+
+    // 每个reactor一个监听socket和一个epoll对象
+    reactor reactors[MAX_REACTOR_NUMBER];
+    for (int i = 0; i < reactor_number; i++) {
+        reactors[i].listenfd = create_listenfd(port);
+        if (reactors[i].listenfd < 0) {
+            printf("bind port %d failure\n", port);
+            exit(-1);
         }
+        reactors[i].epollfd = epoll_create(5);
+
+        // 将监听的文件描述符添加到epoll对象中
+        addfd(reactors[i].epollfd, reactors[i].listenfd, false);
+        reactors[i].pool = pool;
+        reactors[i].users = users;
+        reactors[i].timers = new time_wheel;
     }
 
-    close(epollfd);
-    close(listenfd);
+    // 第0个reactor就在主线程里跑，其余的各开一个线程
+    pthread_t tids[MAX_REACTOR_NUMBER];
+    for (int i = 1; i < reactor_number; i++) {
+        if (pthread_create(tids + i, NULL, reactor_loop, reactors + i) != 0) {
+            printf("create the %dth reactor failure\n", i);
+            exit(-1);
+        }
+    }
+    reactor_loop(reactors);
+    for (int i = 1; i < reactor_number; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; i < reactor_number; i++) {
+        close(reactors[i].epollfd);
+        close(reactors[i].listenfd);
+        delete reactors[i].timers;
+    }
+    print_cache_stats();
     delete [] users;
     delete pool;
     return 0;
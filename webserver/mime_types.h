@@ -0,0 +1,121 @@
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+#include <string.h>
+
+// 文件扩展名 -> MIME类型
+// 整个Content-Type头部在编译期就拼好了，文件加载进缓存时查一次，存在file_entry里，发送响应时直接拷贝
+struct mime_type {
+    const char* ext;       // 小写的扩展名，不带点
+    const char* type;      // MIME类型
+    const char* header;    // 整行Content-Type头部
+    int header_len;
+};
+
+#define MIME_TYPE(ext, type) { ext, type, "Content-Type: " type "\r\n", sizeof("Content-Type: " type "\r\n") - 1 }
+
+// 按扩展名排好序，查找时二分
+constexpr mime_type mime_types[] = {
+    MIME_TYPE("avif", "image/avif"),
+    MIME_TYPE("bmp", "image/bmp"),
+    MIME_TYPE("css", "text/css; charset=utf-8"),
+    MIME_TYPE("csv", "text/csv; charset=utf-8"),
+    MIME_TYPE("gif", "image/gif"),
+    MIME_TYPE("gz", "application/gzip"),
+    MIME_TYPE("htm", "text/html; charset=utf-8"),
+    MIME_TYPE("html", "text/html; charset=utf-8"),
+    MIME_TYPE("ico", "image/x-icon"),
+    MIME_TYPE("jpeg", "image/jpeg"),
+    MIME_TYPE("jpg", "image/jpeg"),
+    MIME_TYPE("js", "text/javascript; charset=utf-8"),
+    MIME_TYPE("json", "application/json"),
+    MIME_TYPE("map", "application/json"),
+    MIME_TYPE("md", "text/markdown; charset=utf-8"),
+    MIME_TYPE("mjs", "text/javascript; charset=utf-8"),
+    MIME_TYPE("mp3", "audio/mpeg"),
+    MIME_TYPE("mp4", "video/mp4"),
+    MIME_TYPE("ogg", "audio/ogg"),
+    MIME_TYPE("otf", "font/otf"),
+    MIME_TYPE("pdf", "application/pdf"),
+    MIME_TYPE("png", "image/png"),
+    MIME_TYPE("svg", "image/svg+xml"),
+    MIME_TYPE("tar", "application/x-tar"),
+    MIME_TYPE("ttf", "font/ttf"),
+    MIME_TYPE("txt", "text/plain; charset=utf-8"),
+    MIME_TYPE("wasm", "application/wasm"),
+    MIME_TYPE("wav", "audio/wav"),
+    MIME_TYPE("webm", "video/webm"),
+    MIME_TYPE("webp", "image/webp"),
+    MIME_TYPE("woff", "font/woff"),
+    MIME_TYPE("woff2", "font/woff2"),
+    MIME_TYPE("xml", "application/xml"),
+    MIME_TYPE("zip", "application/zip"),
+};
+
+// 没有扩展名或者不认识的扩展名，让浏览器当成二进制下载，不去猜
+constexpr mime_type default_mime_type = MIME_TYPE("", "application/octet-stream");
+
+#undef MIME_TYPE
+
+constexpr int MIME_TYPE_COUNT = sizeof(mime_types) / sizeof(mime_types[0]);
+constexpr int MIME_EXT_MAX = 8;   // 最长的扩展名加上结尾的'\0'
+
+constexpr int mime_ext_compare(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+// 编译期检查表是按扩展名严格递增的，扩展名都是小写并且不超过MIME_EXT_MAX，否则二分会找错
+constexpr bool mime_types_valid() {
+    for (int i = 0; i < MIME_TYPE_COUNT; i++) {
+        int len = 0;
+        for (const char* p = mime_types[i].ext; *p; p++, len++) {
+            if (*p >= 'A' && *p <= 'Z') {
+                return false;
+            }
+        }
+        if (len >= MIME_EXT_MAX || (i > 0 && mime_ext_compare(mime_types[i - 1].ext, mime_types[i].ext) >= 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(mime_types_valid(), "mime_types must be sorted by lowercase extension");
+
+// 根据路径的扩展名查MIME类型，扩展名不区分大小写
+inline const mime_type* lookup_mime_type(const char* path) {
+    const char* dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/')) {
+        return &default_mime_type;
+    }
+    char ext[MIME_EXT_MAX];
+    int len = 0;
+    for (const char* p = dot + 1; *p; p++) {
+        if (len == MIME_EXT_MAX - 1) {
+            return &default_mime_type;
+        }
+        ext[len++] = (*p >= 'A' && *p <= 'Z') ? *p | 0x20 : *p;
+    }
+    ext[len] = '\0';
+
+    int lo = 0, hi = MIME_TYPE_COUNT - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = mime_ext_compare(ext, mime_types[mid].ext);
+        if (cmp == 0) {
+            return &mime_types[mid];
+        }
+        if (cmp < 0) {
+            hi = mid - 1;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return &default_mime_type;
+}
+
+#endif
@@ -26,164 +26,179 @@ public:
    time_t expire;   // 任务超时时间，这里使用绝对时间
    void (*cb_func)( client_data* ); // 任务回调函数，回调函数处理的客户数据，由定时器的执行者传递给回调函数
    client_data* user_data; 
-   util_timer* prev;    // 指向前一个定时器
-   util_timer* next;    // 指向后一个定时器
+   util_timer* prev;    // 指向槽中的前一个定时器
+   util_timer* next;    // 指向槽中的后一个定时器
 };
 
-// 定时器链表，它是一个升序、双向链表，且带有头节点和尾节点。
-class sort_timer_lst {
+/* 分层时间轮，代替原来的升序链表。
+   升序链表插入和调整定时器都要从头遍历找位置，是O(n)的，连接一多，每次读写调整一下定时器都很慢。
+   时间轮把时间分成一个个槽，每个槽一个双向循环链表，定时器按超时时间直接挂到对应的槽上，
+   插入、删除、调整都是O(1)的；tick()只处理到期的那个槽，花的时间和到期的定时器个数成正比，和连接总数无关。
+   一层轮子的槽数有限，所以像时钟的时、分、秒一样分了4层：第0层256个槽，每槽1秒；第1层64个槽，每槽256秒；
+   第2层每槽256*64秒……离现在远的定时器挂在高层，等低层转完一圈时再搬(cascade)到低一层，最后在第0层到期。*/
+class time_wheel {
 public:
-    sort_timer_lst() : head( NULL ), tail( NULL ) {}
-    // 链表被销毁时，删除其中所有的定时器
-    ~sort_timer_lst() {
-        util_timer* tmp = head;
-        while( tmp ) {
-            head = tmp->next;
-            delete tmp;
-            tmp = head;
-        }
-    }
-    
-    // 将目标定时器timer添加到链表中
-    void add_timer( util_timer* timer ) {
-        if( !timer ) {
-            return;
+    time_wheel() : cur_time( 0 ), count( 0 ) {
+        // 每个槽的头结点是一个哨兵，空槽的prev和next都指向自己
+        for( int i = 0; i < SLOTS_0; ++i ) {
+            slots0[i].prev = slots0[i].next = &slots0[i];
         }
-        if( !head ) {
-            head = tail = timer;
-            return; 
-        }
-        /* 如果目标定时器的超时时间小于当前链表中所有定时器的超时时间，则把该定时器插入链表头部,作为链表新的头节点，
-           否则就需要调用重载函数 add_timer(),把它插入链表中合适的位置，以保证链表的升序特性 */
-        if( timer->expire < head->expire ) {
-            timer->next = head;
-            head->prev = timer;
-            head = timer;
-            return;
+        for( int i = 0; i < LEVELS - 1; ++i ) {
+            for( int j = 0; j < SLOTS; ++j ) {
+                slots[i][j].prev = slots[i][j].next = &slots[i][j];
+            }
         }
-        add_timer(timer, head);
     }
-    
-    /* 当某个定时任务发生变化时，调整对应的定时器在链表中的位置。这个函数只考虑被调整的定时器的
-    超时时间延长的情况，即该定时器需要往链表的尾部移动。*/
-    void adjust_timer(util_timer* timer)
-    {
-        if( !timer )  {
-            return;
-        }
-        util_timer* tmp = timer->next;
-        // 如果被调整的目标定时器处在链表的尾部，或者该定时器新的超时时间值仍然小于其下一个定时器的超时时间则不用调整
-        if( !tmp || ( timer->expire < tmp->expire ) ) {
-            return;
+    // 时间轮被销毁时，删除其中所有的定时器
+    ~time_wheel() {
+        for( int i = 0; i < SLOTS_0; ++i ) {
+            clear( &slots0[i] );
         }
-        // 如果目标定时器是链表的头节点，则将该定时器从链表中取出并重新插入链表
-        if( timer == head ) {
-            head = head->next;
-            head->prev = NULL;
-            timer->next = NULL;
-            add_timer( timer, head );
-        } else {
-            // 如果目标定时器不是链表的头节点，则将该定时器从链表中取出，然后插入其原来所在位置后的部分链表中
-            timer->prev->next = timer->next;
-            timer->next->prev = timer->prev;
-            add_timer( timer, timer->next );
+        for( int i = 0; i < LEVELS - 1; ++i ) {
+            for( int j = 0; j < SLOTS; ++j ) {
+                clear( &slots[i][j] );
+            }
         }
     }
-    // 将目标定时器 timer 从链表中删除
-    void del_timer( util_timer* timer )
-    {
+
+    // 将目标定时器timer添加到时间轮中
+    void add_timer( util_timer* timer ) {
         if( !timer ) {
             return;
         }
-        // 下面这个条件成立表示链表中只有一个定时器，即目标定时器
-        if( ( timer == head ) && ( timer == tail ) ) {
-            delete timer;
-            head = NULL;
-            tail = NULL;
-            return;
+        if( count == 0 ) {
+            // 轮子是空的，可能很久没转了，先把当前时间对上
+            cur_time = time( NULL );
         }
-        /* 如果链表中至少有两个定时器，且目标定时器是链表的头节点，
-         则将链表的头节点重置为原头节点的下一个节点，然后删除目标定时器。 */
-        if( timer == head ) {
-            head = head->next;
-            head->prev = NULL;
-            delete timer;
+        link( timer );
+        count++;
+    }
+
+    // 定时器的超时时间变了，把它挂到新的槽上，不管时间是延长还是缩短都可以
+    void adjust_timer( util_timer* timer ) {
+        if( !timer ) {
             return;
         }
-        /* 如果链表中至少有两个定时器，且目标定时器是链表的尾节点，
-        则将链表的尾节点重置为原尾节点的前一个节点，然后删除目标定时器。*/
-        if( timer == tail ) {
-            tail = tail->prev;
-            tail->next = NULL;
-            delete timer;
+        unlink( timer );
+        link( timer );
+    }
+
+    // 将目标定时器 timer 从时间轮中删除
+    void del_timer( util_timer* timer ) {
+        if( !timer ) {
             return;
         }
-        // 如果目标定时器位于链表的中间，则把它前后的定时器串联起来，然后删除目标定时器
-        timer->prev->next = timer->next;
-        timer->next->prev = timer->prev;
+        unlink( timer );
+        count--;
         delete timer;
     }
 
-    /* SIGALARM 信号每次被触发就在其信号处理函数中执行一次 tick() 函数，以处理链表上到期任务。*/
+    /* 每次epoll_wait返回后都调用一次tick()，把从上次到现在这几秒里到期的定时器都处理掉。
+       没有到期的秒数时直接返回，所以多调几次也没关系 */
     void tick() {
-        if( !head ) {
+        time_t cur = time( NULL );  // 获取当前系统时间
+        if( count == 0 ) {
+            cur_time = cur + 1;
             return;
         }
-        printf( "timer tick\n" );
-        time_t cur = time( NULL );  // 获取当前系统时间
-        util_timer* tmp = head;
-        // 从头节点开始依次处理每个定时器，直到遇到一个尚未到期的定时器
-        while( tmp ) {
-            /* 因为每个定时器都使用绝对时间作为超时值，所以可以把定时器的超时值和系统当前时间，
-            比较以判断定时器是否到期*/
-            if( cur < tmp->expire ) {
-                break;
+        // cur_time是下一个要处理的秒，一秒一秒地往前转到当前时间
+        while( cur_time <= cur ) {
+            int idx = cur_time & ( SLOTS_0 - 1 );
+            if( idx == 0 ) {
+                // 第0层转完了一圈，把上一层当前槽中的定时器搬下来，上一层也转完一圈的话继续往上
+                for( int level = 1; level < LEVELS; ++level ) {
+                    int i = ( cur_time >> ( SLOT_BITS_0 + ( level - 1 ) * SLOT_BITS ) ) & ( SLOTS - 1 );
+                    cascade( level, i );
+                    if( i != 0 ) {
+                        break;
+                    }
+                }
             }
 
-            // 调用定时器的回调函数，以执行定时任务
-            tmp->cb_func( tmp->user_data );
-            // 执行完定时器中的定时任务之后，就将它从链表中删除，并重置链表头节点
-            head = tmp->next;
-            if( head ) {
-                head->prev = NULL;
+            // 调用定时器的回调函数，以执行定时任务，执行完之后就将它从时间轮中删除
+            util_timer* head = &slots0[idx];
+            while( head->next != head ) {
+                util_timer* tmp = head->next;
+                unlink( tmp );
+                count--;
+                tmp->cb_func( tmp->user_data );
+                delete tmp;
             }
-            delete tmp;
-            tmp = head;
+            cur_time++;
         }
     }
 
+    // epoll_wait最多等多少毫秒就要回来调用tick()，没有定时器时返回-1，一直等
+    int get_timeout() const {
+        return count == 0 ? -1 : 1000;
+    }
+
 private:
-    /* 一个重载的辅助函数，它被公有的 add_timer 函数和 adjust_timer 函数调用
-    该函数表示将目标定时器 timer 添加到节点 lst_head 之后的部分链表中 */
-    void add_timer(util_timer* timer, util_timer* lst_head)  {
-        util_timer* prev = lst_head;
-        util_timer* tmp = prev->next;
-        /* 遍历 list_head 节点之后的部分链表，直到找到一个超时时间大于目标定时器的超时时间节点
-        并将目标定时器插入该节点之前 */
-        while(tmp) {
-            if( timer->expire < tmp->expire ) {
-                prev->next = timer;
-                timer->next = tmp;
-                tmp->prev = timer;
-                timer->prev = prev;
-                break;
+    static const int LEVELS = 4;           // 轮子的层数
+    static const int SLOT_BITS_0 = 8;
+    static const int SLOTS_0 = 1 << SLOT_BITS_0;   // 第0层的槽数
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;       // 其它层的槽数
+
+    // 根据超时时间算出定时器应该在哪一层的哪个槽，然后挂上去
+    void link( util_timer* timer ) {
+        time_t expire = timer->expire;
+        if( expire < cur_time ) {
+            expire = cur_time;   // 已经超时了，下一次tick就处理
+        }
+        time_t delta = expire - cur_time;
+        util_timer* head;
+        if( delta < SLOTS_0 ) {
+            head = &slots0[expire & ( SLOTS_0 - 1 )];
+        } else {
+            int level = 1;
+            int shift = SLOT_BITS_0;
+            while( level < LEVELS - 1 && delta >= ( (time_t)1 << ( shift + SLOT_BITS ) ) ) {
+                level++;
+                shift += SLOT_BITS;
             }
-            prev = tmp;
-            tmp = tmp->next;
+            if( delta >= ( (time_t)1 << ( shift + SLOT_BITS ) ) ) {
+                expire = cur_time + ( (time_t)1 << ( shift + SLOT_BITS ) ) - 1;   // 超出最高层的范围，放在最高层的最远处
+            }
+            head = &slots[level - 1][( expire >> shift ) & ( SLOTS - 1 )];
         }
-        /* 如果遍历完 lst_head 节点之后的部分链表，仍未找到超时时间大于目标定时器的超时时间的节点，
-           则将目标定时器插入链表尾部，并把它设置为链表新的尾节点。*/
-        if( !tmp ) {
-            prev->next = timer;
-            timer->prev = prev;
-            timer->next = NULL;
-            tail = timer;
+        timer->next = head;
+        timer->prev = head->prev;
+        head->prev->next = timer;
+        head->prev = timer;
+    }
+
+    // 从所在的槽中摘下来
+    void unlink( util_timer* timer ) {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = timer->next = NULL;
+    }
+
+    // 删除一个槽中所有的定时器
+    void clear( util_timer* head ) {
+        while( head->next != head ) {
+            util_timer* tmp = head->next;
+            unlink( tmp );
+            delete tmp;
+        }
+    }
+
+    // 把第level层第idx个槽中的定时器重新挂一遍，它们离到期更近了，会挂到低一层
+    void cascade( int level, int idx ) {
+        util_timer* head = &slots[level - 1][idx];
+        while( head->next != head ) {
+            util_timer* tmp = head->next;
+            unlink( tmp );
+            link( tmp );
         }
     }
 
 private:
-    util_timer* head;   // 头结点
-    util_timer* tail;   // 尾结点
+    util_timer slots0[SLOTS_0];          // 第0层，每槽1秒
+    util_timer slots[LEVELS - 1][SLOTS]; // 第1层到第LEVELS-1层，第level层是slots[level - 1]
+    time_t cur_time;                     // 下一个要处理的秒
+    int count;                           // 时间轮中定时器的个数
 };
 
 #endif
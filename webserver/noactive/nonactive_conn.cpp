@@ -19,7 +19,7 @@
 #define TIMESLOT 5
 
 static int pipefd[2];
-static sort_timer_lst timer_lst;
+static time_wheel timer_wheel;
 static int epollfd = 0;
 
 int setnonblocking( int fd )
@@ -57,18 +57,6 @@ void addsig( int sig )
     assert( sigaction( sig, &sa, NULL ) != -1 );
 }
 
-// 这个定时任务：每五秒钟触发一次SIGALARM，调用tick()，即： 每5秒钟去检查一次，每个任务的超时时间是否到达，如果到达，删掉这个任务（每5秒去遍历一遍链表）
-// 这个定时任务：每五秒钟触发一次SIGALARM，调用tick()，即： 每5秒钟去检查一次，每个任务的超时时间是否到达，如果到达，删掉这个任务（每5秒去遍历一遍链表）
-// 这个定时任务：每五秒钟触发一次SIGALARM，调用tick()，即： 每5秒钟去检查一次，每个任务的超时时间是否到达，如果到达，删掉这个任务（每5秒去遍历一遍链表）
-// 这个定时任务：每五秒钟触发一次SIGALARM，调用tick()，即： 每5秒钟去检查一次，每个任务的超时时间是否到达，如果到达，删掉这个任务（每5秒去遍历一遍链表）
-void timer_handler()
-{
-    // 定时处理任务，实际上就是调用tick()函数
-    timer_lst.tick(); 
-    // 因为一次 alarm 调用只会引起一次SIGALARM 信号，所以我们要重新定时，以不断触发 SIGALARM信号。
-    alarm(TIMESLOT);
-}
-
 // 定时器回调函数，它删除非活动连接socket上的注册事件，并关闭之。
 void cb_func( client_data* user_data )
 {
@@ -113,17 +101,15 @@ int main( int argc, char* argv[] ) {
     addfd( epollfd, pipefd[0] );   // 读， 将pipefd[0]交给epoll监管，监听读
 
     // 设置信号处理函数
-    addsig( SIGALRM );   // 只要发生SIGALRM信号，就调用信号处理函数，将这个信号值写进管道，由epoll来监听
-    addsig( SIGTERM );
+    addsig( SIGTERM );   // 只要发生SIGTERM信号，就调用信号处理函数，将这个信号值写进管道，由epoll来监听
     bool stop_server = false;
 
     client_data* users = new client_data[FD_LIMIT]; 
-    bool timeout = false;
-    alarm(TIMESLOT);  // 定时,5秒后产生SIGALARM信号
 
     while( !stop_server )
     {
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
+        // 不再用alarm定时，epoll_wait最多等到下一个tick就返回，有定时器时每秒转一格时间轮
+        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, timer_wheel.get_timeout() );
         if ( ( number < 0 ) && ( errno != EINTR ) ) {
             printf( "epoll failure\n" );
             break;
@@ -140,14 +126,14 @@ int main( int argc, char* argv[] ) {
                 users[connfd].address = client_address;
                 users[connfd].sockfd = connfd;
                 
-                // 创建定时器，设置其回调函数与超时时间，然后绑定定时器与用户数据，最后将定时器添加到链表timer_lst中
+                // 创建定时器，设置其回调函数与超时时间，然后绑定定时器与用户数据，最后将定时器添加到时间轮timer_wheel中
                 util_timer* timer = new util_timer;
                 timer->user_data = &users[connfd];
                 timer->cb_func = cb_func;  // 这里指定
                 time_t cur = time( NULL );
                 timer->expire = cur + 3 * TIMESLOT;
                 users[connfd].timer = timer;
-                timer_lst.add_timer( timer );
+                timer_wheel.add_timer( timer );
             } else if( ( sockfd == pipefd[0] ) && ( events[i].events & EPOLLIN ) ) {
                 // 处理信号
                 int sig;
@@ -160,13 +146,6 @@ int main( int argc, char* argv[] ) {
                 } else  {
                     for( int i = 0; i < ret; ++i ) {
                         switch( signals[i] )  {
-                            case SIGALRM:
-                            {
-                                // 用timeout变量标记有定时任务需要处理，但不立即处理定时任务
-                                // 这是因为定时任务的优先级不是很高，我们优先处理其他更重要的任务。
-                                timeout = true;
-                                break;
-                            }
                             case SIGTERM:
                             {
                                 stop_server = true;
@@ -189,7 +168,7 @@ int main( int argc, char* argv[] ) {
                         cb_func( &users[sockfd] );
                         if( timer )
                         {
-                            timer_lst.del_timer( timer );
+                            timer_wheel.del_timer( timer );
                         }
                     }
                 }
@@ -199,7 +178,7 @@ int main( int argc, char* argv[] ) {
                     cb_func( &users[sockfd] );
                     if( timer )
                     {
-                        timer_lst.del_timer( timer );
+                        timer_wheel.del_timer( timer );
                     }
                 }
                 else
@@ -209,7 +188,7 @@ int main( int argc, char* argv[] ) {
                         time_t cur = time( NULL );
                         timer->expire = cur + 3 * TIMESLOT;
                         printf( "adjust timer once\n" );
-                        timer_lst.adjust_timer( timer );
+                        timer_wheel.adjust_timer( timer );
                     }
                 }
             }
@@ -217,10 +196,7 @@ int main( int argc, char* argv[] ) {
         }
 
         // 最后处理定时事件，因为I/O事件有更高的优先级。当然，这样做将导致定时任务不能精准的按照预定的时间执行。
-        if( timeout ) {
-            timer_handler();
-            timeout = false;
-        }
+        timer_wheel.tick();
     }
 
     close( listenfd );
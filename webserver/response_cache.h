@@ -0,0 +1,75 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <time.h>
+#include <atomic>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+#include "file_cache.h"
+
+// 缓存的一个HTTP响应
+// 响应头和文件内容预先拼在一块连续的内存里，命中时只需现写状态行和Date，和它一起一次writev发完
+struct cached_response {
+    char* data;               // 状态行和Date之后的响应头 + 文件内容
+    int len;                  // data的长度
+    file_entry* file;         // 生成这个响应的文件，文件被修改后(stale)这个响应也作废
+    std :: string key;        // 在缓存中的键
+    std :: list<cached_response*> :: iterator lru;   // 在LRU链表中的位置
+    std :: atomic<int> ref;   // 引用计数，缓存自己一个，正在发送它的连接各一个
+};
+
+// 小文件响应缓存，按字节数限制总大小，超出后按LRU淘汰
+// 同一个路径，保持连接和不保持连接的响应头不一样，分别缓存
+class response_cache {
+public:
+    static const int MAX_FILE_SIZE = 64 * 1024;   // 只缓存不超过这个大小的文件
+    static const int STATS_INTERVAL = 60;         // 每隔这么多秒报告一次统计信息
+
+    static response_cache* get_instance() {
+        static response_cache instance;
+        return &instance;
+    }
+
+    // 设置缓存的总字节数上限，0表示不缓存
+    void init(long max_bytes);
+
+    // 查找url对应的响应，命中时引用计数加一，用完后调用release
+    cached_response* acquire(const char* url, bool linger);
+
+    // 用已经写好的响应头和文件内容生成一个响应放进缓存，返回时已经加了一个引用
+    // 文件太大或者放不下时返回NULL
+    cached_response* insert(const char* url, bool linger, const char* header, int header_len, file_entry* file);
+
+    void release(cached_response* response);
+
+    // 统计信息
+    unsigned long hits() const { return m_hits; }
+    unsigned long misses() const { return m_misses; }
+    unsigned long evictions() const { return m_evictions; }
+    long bytes() const { return m_bytes; }
+
+    // 距上次报告过了STATS_INTERVAL秒时返回true，多个线程同时调用只有一个拿到true
+    bool stats_due(time_t now);
+
+private:
+    response_cache();
+    ~response_cache();
+
+    void remove(cached_response* response);   // 从缓存中拿掉，调用前要加锁
+
+private:
+    long m_max_bytes;    // 缓存总大小的上限
+    long m_bytes;        // 缓存当前的总大小
+    std :: unordered_map<std :: string, cached_response*> m_responses;
+    std :: list<cached_response*> m_lru;      // 最近用过的在前面，淘汰从后面开始
+    locker m_lock;
+
+    std :: atomic<unsigned long> m_hits;        // 命中次数
+    std :: atomic<unsigned long> m_misses;      // 未命中次数
+    std :: atomic<unsigned long> m_evictions;   // 因为超出大小被淘汰的次数
+    std :: atomic<long> m_last_stats;           // 上次报告统计信息的时间
+};
+
+#endif
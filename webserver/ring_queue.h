@@ -0,0 +1,130 @@
+#ifndef RING_QUEUE_H
+#define RING_QUEUE_H
+
+#include <atomic>
+#include <exception>
+#include <stddef.h>
+
+// 有界的多生产者多消费者无锁环形队列 (Dmitry Vyukov 的 bounded MPMC queue)
+// 每个槽带一个序号seq：
+//   seq == pos          槽是空的，生产者可以往位置pos写
+//   seq == pos + 1      槽里有数据，消费者可以从位置pos读
+//   读完后seq改成pos + 容量，等生产者下一圈再来写
+// 生产者和消费者各自只在入队/出队位置上做一次CAS，不加锁，也不用像std::list那样每次入队都分配一个节点
+template<typename T>
+class ring_queue {
+public:
+    // 容量向上取整到2的幂，这样取模可以用位与
+    explicit ring_queue(int capacity);
+    ~ring_queue();
+
+    // 队列满了返回false
+    bool push(T* item);
+
+    // 一次最多取出max个，返回实际取出的个数，队列空时返回0
+    // 连续的几个槽只用一次CAS就全部拿走，减少消费者之间的竞争
+    int pop(T** items, int max);
+
+private:
+    struct cell {
+        std :: atomic<size_t> seq;
+        T* data;
+    };
+
+    cell* m_buffer;
+    size_t m_mask;
+
+    // 入队位置和出队位置分别被生产者和消费者频繁修改，隔开放在不同的缓存行里，避免伪共享
+    char m_pad0[64];
+    std :: atomic<size_t> m_enqueue_pos;
+    char m_pad1[64];
+    std :: atomic<size_t> m_dequeue_pos;
+    char m_pad2[64];
+};
+
+template<typename T>
+ring_queue<T> :: ring_queue(int capacity) : m_buffer(NULL), m_mask(0) {
+    if (capacity <= 0) {
+        throw std :: exception();
+    }
+    size_t size = 1;
+    while (size < (size_t)capacity) {
+        size <<= 1;
+    }
+    m_buffer = new cell[size];
+    m_mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        m_buffer[i].seq.store(i, std :: memory_order_relaxed);
+    }
+    m_enqueue_pos.store(0, std :: memory_order_relaxed);
+    m_dequeue_pos.store(0, std :: memory_order_relaxed);
+}
+
+template<typename T>
+ring_queue<T> :: ~ring_queue() {
+    delete [] m_buffer;
+}
+
+template<typename T>
+bool ring_queue<T> :: push(T* item) {
+    size_t pos = m_enqueue_pos.load(std :: memory_order_relaxed);
+    cell* c;
+    while (true) {
+        c = &m_buffer[pos & m_mask];
+        size_t seq = c -> seq.load(std :: memory_order_acquire);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            // 槽是空的，抢这个位置
+            if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std :: memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // 槽里还是上一圈的数据没被取走，队列满了
+            return false;
+        } else {
+            // 被别的生产者抢先了，重新读位置
+            pos = m_enqueue_pos.load(std :: memory_order_relaxed);
+        }
+    }
+    c -> data = item;
+    c -> seq.store(pos + 1, std :: memory_order_release);
+    return true;
+}
+
+template<typename T>
+int ring_queue<T> :: pop(T** items, int max) {
+    size_t pos = m_dequeue_pos.load(std :: memory_order_relaxed);
+    int n;
+    while (true) {
+        // 从pos开始数有几个连续的槽已经有数据了
+        n = 0;
+        while (n < max) {
+            size_t seq = m_buffer[(pos + n) & m_mask].seq.load(std :: memory_order_acquire);
+            if ((long)seq - (long)(pos + n + 1) != 0) {
+                break;
+            }
+            n++;
+        }
+        if (n == 0) {
+            size_t seq = m_buffer[pos & m_mask].seq.load(std :: memory_order_acquire);
+            if ((long)seq - (long)(pos + 1) < 0) {
+                return 0;   // 队列空
+            }
+            // 被别的消费者抢先了
+            pos = m_dequeue_pos.load(std :: memory_order_relaxed);
+            continue;
+        }
+        // 一次把这n个位置都占下来
+        if (m_dequeue_pos.compare_exchange_weak(pos, pos + n, std :: memory_order_relaxed)) {
+            break;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        cell* c = &m_buffer[(pos + i) & m_mask];
+        items[i] = c -> data;
+        c -> seq.store(pos + i + m_mask + 1, std :: memory_order_release);
+    }
+    return n;
+}
+
+#endif
@@ -2,24 +2,57 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
-#include <list>
+#include <atomic>
 #include "locker.h"
+#include "ring_queue.h"
 #include <exception>
 #include <cstdio>
+#include <stdint.h>
 
 
 // 线程池类，定义成模板类是为了代码的复用
 // 这个线程池类，是将线程池，和任务的请求队列，都放在一起了
+// 每个工作线程有自己的请求队列，同一个连接的请求总是先交给同一个线程，连接的读写缓冲区就一直留在那个核的缓存里；
+// 某个线程自己的队列空了，就去别的线程的队列里偷任务，不让忙的线程一直积压
 template<typename T>
 class threadpool {
 public:
     threadpool(int thread_number = 8, int max_requests = 10000);
     ~threadpool();
     bool append(T* request);
-    void run();
+    void run(int index);
 
 private:
+    // 每个工作线程一份
+    struct worker_queue {
+        worker_queue(threadpool* p, int i, int capacity) : pool(p), index(i), queue(capacity), sleeping(false) {}
+
+        threadpool* pool;
+        int index;                        // 第几个工作线程
+        ring_queue<T> queue;              // 优先交给这个线程的请求
+        sem wakeup;                       // 这个线程没事做时睡在这里
+        std :: atomic<bool> sleeping;     // 是否正在睡眠(或者准备睡眠)，叫醒它的人负责把它改回false
+    };
+
     static void* worker(void* arg);
+
+    // 取一批任务：先取自己队列里的，没有就去偷别人的；都没有时先自旋一会儿，还没有才睡在自己的信号量上
+    int take(worker_queue* q, T** requests);
+
+    // 从自己的队列取，或者从别的线程的队列偷
+    int grab(worker_queue* q, T** requests);
+
+    // 叫醒一个正在睡眠的线程，成功返回true
+    bool wake(worker_queue* q);
+
+    // 工作线程一次最多从自己的队列里取出的任务数
+    static const int BATCH_SIZE = 8;
+
+    // 一次最多偷的任务数，偷少一点，尽量让任务留在原来的线程上
+    static const int STEAL_SIZE = 2;
+
+    // 队列空了以后，睡眠之前先自旋检查的次数
+    static const int SPIN_COUNT = 128;
      
 private:
 
@@ -32,14 +65,11 @@ private:
     // 请求队列中最多允许的，等待处理的请求数量
     int m_max_requests;
 
-    // 请求队列
-    std :: list<T*> m_workqueue;
-
-    // 互斥锁, 保护请求队列的
-    locker m_queuelocker;
+    // 每个工作线程的请求队列，每个的大小是m_max_requests / m_thread_number
+    worker_queue** m_queues;
 
-    // 信号量用来判断是否有任务需要处理
-    sem m_queuestat;
+    // 正在睡眠(或者准备睡眠)的线程数，为0时append就不用去找谁来偷任务
+    std :: atomic<int> m_idle;
 
     // 是否结束线程，这个是结束所有的线程
     bool m_stop;
@@ -49,6 +79,7 @@ private:
 template <typename T>
 threadpool<T> :: threadpool(int thread_number, int max_requests):
     m_thread_number(thread_number), m_max_requests(max_requests),
+    m_queues(NULL), m_idle(0),
     m_stop(false), m_threads(NULL) {
         if ((thread_number <= 0) || (max_requests <= 0)) {
             throw std :: exception();
@@ -59,13 +90,19 @@ threadpool<T> :: threadpool(int thread_number, int max_requests):
             throw std:: exception();
         }
 
+        int capacity = max_requests / thread_number > 0 ? max_requests / thread_number : 1;
+        m_queues = new worker_queue*[m_thread_number];
+        for (int i = 0; i < thread_number; i++) {
+            m_queues[i] = new worker_queue(this, i, capacity);
+        }
+
         // 创建thread_number个线程，并将它们设置为线程脱离
         for (int i = 0; i < thread_number; i++){
             printf("create the %dth thread\n", i);
 
             // 由于这里的worker是静态函数，静态成员函数里是不能调用成员变量的，所以直接将对象作为参数
-            // 导进静态成员函数中去，即将this作为参数，这样就可以调用该对象的成员变量了
-            if (pthread_create(m_threads + i, NULL, worker, this) != 0 ) {
+            // 导进静态成员函数中去，这里传的是这个线程自己的队列，里面有指回线程池的指针
+            if (pthread_create(m_threads + i, NULL, worker, m_queues[i]) != 0 ) {
                 delete [] m_threads;
                 throw std :: exception();
             }
@@ -83,60 +120,129 @@ template <typename T>
 threadpool<T>::~threadpool() {
     delete [] m_threads;
     m_stop = true;
+    // 工作线程是分离的，这时可能还在访问自己的队列，所以m_queues不在这里释放
 
 }
 
 template <typename T>
 bool threadpool<T>:: append(T* request){
 
-    m_queuelocker.lock();
-    if (m_workqueue.size() > m_max_requests) {
-        m_queuelocker.unlock();
+    // 同一个对象(对http_conn来说就是同一个连接)总是先交给同一个线程，它的队列满了再依次试后面的线程
+    int start = (int)(((uintptr_t)request / sizeof(T)) % m_thread_number);
+    worker_queue* q = NULL;
+    for (int i = 0; i < m_thread_number; i++) {
+        worker_queue* candidate = m_queues[(start + i) % m_thread_number];
+        if (candidate -> queue.push(request)) {
+            q = candidate;
+            break;
+        }
+    }
+    // 所有队列都满了
+    if (!q) {
         return false;
     }
 
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    // 信号量增加
-    m_queuestat.post();
+    // 和take()里的fence配对：要么这里看到了对方的sleeping，要么对方睡眠前的那次检查能看到刚放进去的任务
+    std :: atomic_thread_fence(std :: memory_order_seq_cst);
+    if (wake(q)) {
+        return true;
+    }
+    // 这个线程正忙着，如果有闲着的线程，叫醒一个来偷
+    if (m_idle.load(std :: memory_order_relaxed) > 0) {
+        for (int i = 1; i < m_thread_number; i++) {
+            if (wake(m_queues[(q -> index + i) % m_thread_number])) {
+                break;
+            }
+        }
+    }
 
     return true;
     
 }
 
+template <typename T>
+bool threadpool<T>::wake(worker_queue* q) {
+    // 先读一下，大部分时候线程都醒着，不用做原子交换
+    if (q -> sleeping.load(std :: memory_order_relaxed) && q -> sleeping.exchange(false)) {
+        q -> wakeup.post();
+        return true;
+    }
+    return false;
+}
+
 template <typename T>
 void* threadpool<T>::worker(void* arg){
 
-    threadpool* pool = (threadpool*)arg;
+    worker_queue* q = (worker_queue*)arg;
     // 创建出线程，目的是为了拿出请求队列中的任务，这也正是worker中要干的事
-    pool -> run();
-    return pool;
+    q -> pool -> run(q -> index);
+    return q -> pool;
 }
 
 template <typename T>
-void threadpool<T>::run (){
-    while(!m_stop) {
-        // 判断是否需要堵塞，信号值减一
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if (m_workqueue.empty()) {
-            m_queuelocker.unlock();
-            continue;
+int threadpool<T>::grab(worker_queue* q, T** requests) {
+    int n = q -> queue.pop(requests, BATCH_SIZE);
+    if (n > 0) {
+        return n;
+    }
+    // 自己没事做了，从下一个线程开始依次去偷
+    for (int i = 1; i < m_thread_number; i++) {
+        n = m_queues[(q -> index + i) % m_thread_number] -> queue.pop(requests, STEAL_SIZE);
+        if (n > 0) {
+            return n;
         }
-        
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();  // 取出之后，删掉这个任务
-        m_queuelocker.unlock();
-
-        // 感觉这步有点多余，因为上面已经判读过m_workqueue工作队列是否为空，所以这里坑定是拿到请求了
-        if (!request) {
-            continue;
+    }
+    return 0;
+}
+
+template <typename T>
+int threadpool<T>::take(worker_queue* q, T** requests) {
+    while (!m_stop) {
+        int n = grab(q, requests);
+        if (n > 0) {
+            return n;
         }
-        // 这个才是针对一个任务，要进行的处理
-        request -> process();
 
+        // 请求一般是一阵一阵来的，先自旋一会儿，很可能马上就有新任务，不用睡下去再被叫醒
+        for (int i = 0; i < SPIN_COUNT; i++) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+            n = grab(q, requests);
+            if (n > 0) {
+                return n;
+            }
+        }
 
+        // 先登记自己要睡了，再最后检查一次所有队列，这样append放进任务时一定能看到有线程在睡，不会漏掉唤醒
+        q -> sleeping.store(true);
+        m_idle.fetch_add(1);
+        std :: atomic_thread_fence(std :: memory_order_seq_cst);
+        n = grab(q, requests);
+        if (n == 0 || !q -> sleeping.exchange(false)) {
+            // 没有任务，判断是否需要堵塞，信号值减一
+            // 或者已经有人把sleeping改掉并post了，把这次post消耗掉，免得下次睡眠时直接返回
+            q -> wakeup.wait();
+        }
+        m_idle.fetch_sub(1);
+        if (n > 0) {
+            return n;
+        }
+    }
+    return 0;
+}
 
+template <typename T>
+void threadpool<T>::run (int index){
+    worker_queue* q = m_queues[index];
+    T* requests[BATCH_SIZE];
+    while(!m_stop) {
+        // 一次取出一批任务，没有任务时会堵塞
+        int n = take(q, requests);
+        for (int i = 0; i < n; i++) {
+            // 这个才是针对一个任务，要进行的处理
+            requests[i] -> process();
+        }
     }
 }
 